@@ -7,270 +7,376 @@
 
 #include <windows.h>
 #include "ni488.h"
-
-#define arr_len(x) (sizeof(x) / sizeof(x[0]))
+#include "gpib_port.h"
+#include "trace.h"
+#include "probe.h"
 
 int GPIB = 0;                 // Board handle
 
 int PAD = 1;                      // Primary address
 int SAD = 0;                      // Secondary address
-bool shutup = false;
-bool port   = false;
-
-typedef void (* f_on_receive)(const char *str, const int len);
-
-struct gpib_dev
-{
-    int dev;
-    f_on_receive on_receive;
-};
-
-struct instru_info 
-{
-    int pad;
-    int sad;
-    char idn[1024];
-};
 
 #define TIMEOUT               T10s  // Timeout value = 10 seconds
 #define EOTMODE               1     // Enable the END message
 #define EOSMODE               0     // Disable the EOS mode
 
-char ErrorMnemonic[21][5] = {"EDVR", "ECIC", "ENOL", "EADR", "EARG",
+char ErrorMnemonic[29][5] = {"EDVR", "ECIC", "ENOL", "EADR", "EARG",
                              "ESAC", "EABO", "ENEB", "EDMA", "",
                              "EOIP", "ECAP", "EFSO", "", "EBUS",
-                             "ESTB", "ESRQ", "", "", "", "ETAB"};
+                             "ESTB", "ESRQ", "", "", "", "ETAB",
+                             "ELCK", "EARM", "EHDL", "", "",
+                             "EWIP", "ERST", "EPWR"};
 
 
 void GPIBCleanup(int ud, const char* ErrorMsg);
 
-#define dbg_print(...) if (!shutup) fprintf(stderr, __VA_ARGS__)
+void help()
+{
+    printf("GPIB client command options: \n");
+    printf("    -port               as an Erlang port\n");
+    printf("    -packet <2|4>       port length prefix, as Erlang {packet, N}\n");
+    printf("    -max_frame <N>      max frame size with -packet 4\n");
+    printf("    -rdsize <N>         max bytes of one device read\n");
+    printf("    -outbuf <N>         batch output frames in N bytes, 0 = off\n");
+    printf("    -flush_us <N>       max time a frame is held back (us)\n");
+    printf("    -proto  <1|2|3>     port protocol, 2 adds request ids, 3 sessions\n");
+    printf("    -handle <N>         board handle\n");
+    printf("    -pad    <N>         primary address\n");
+    printf("    -sad    <N>         primary address\n");
+    printf("    -ls                 list all instruments on a board and quit\n");
+    printf("    -boards <N>         (-ls) scan N boards from -handle on\n");
+    printf("    -probe_ms <N>       (-ls) timeout of one *IDN? probe in ms\n");
+    printf("    -ls_jobs <N>        (-ls) max probes at a time\n");
+    printf("    -json               (-ls) print the list as JSON\n");
+    printf("    -cache  <File>      inventory cache, keeps the learned timeouts\n");
+    printf("    -refresh            (-ls) search the bus and rewrite the cache\n");
+    printf("    -srq                push data on service requests\n");
+    printf("    -read_ahead         read the response of a query write right away\n");
+    printf("    -coalesce <N>       join writes arriving within N us, 0 = off\n");
+    printf("    -tmo_adapt <N>      read timeout N x p99 of the answers, 0 = off\n");
+    printf("    -tmo_min <N>        least adaptive timeout in ms\n");
+    printf("    -tmo_max <N>        most adaptive timeout in ms\n");
+    printf("    -reconnect <N>      keep reopening a lost session for N s\n");
+    printf("    -trace  <N>         trace level, 0 off, 1 error, 2 info, 3 debug\n");
+    printf("    -shutup             suppress all error/debug prints\n");    
+    printf("    -help/-?            show this information\n");
+    printf("Note: Press Enter (empty input) to read device response\n");
+}
+
+#define MAX_BOARDS 8
+
+int boards = 1;                     // -ls scans the boards from GPIB on
+bool ls = false;
 
-#define MAX_COMM_PACK_SIZE 65536
+static Addr4882_t listeners[MAX_BOARDS][31];
+static int listeners_n[MAX_BOARDS];
 
-#define command_write_to_gpib       0
-#define command_read_from_gpib      1
-#define command_dbg_msg             2
-#define command_shutdown            3
+int ni_tmo(long ms);
+int ni_status(gpib_dev *dev);
 
-int read_exact(byte *buf, int len)
+// FindLstn on board GPIB + it->group, called on a probe worker
+void ni_find_board(probe_item *it)
 {
-  int i, got=0;
+    int k = it->group, loop;
+    Addr4882_t Instruments[31];            // Array of primary addresses
 
-  do 
-  {
-    if ((i = read(0, buf + got, len - got)) <= 0)
-      return i;
-    got += i;
-  } while (got < len);
+    SendIFC(GPIB + k);
+    if (ThreadIbsta() & ERR)
+    {
+        it->status = probe_error;
+        return;
+    }
 
-  return len;
+    for (loop = 0; loop < 30; loop++) {
+       Instruments[loop] = (Addr4882_t)(loop + 1);
+    }
+    Instruments[arr_len(Instruments) - 1] = NOADDR;
+
+    FindLstn(GPIB + k, Instruments, listeners[k], arr_len(Instruments));
+    if (ThreadIbsta() & ERR)
+        it->status = probe_error;
+    else
+        listeners_n[k] = ThreadIbcntl();
+    ibonl(GPIB + k, 0);
 }
 
-int write_exact(byte *buf, int len)
+// *IDN? to one listener, with the probe timeout
+void ni_probe(probe_item *it)
 {
-  int i, wrote = 0;
+    int board = 0, pad = 0, sad = 0, ud;
+    char r[256];
 
-  do 
-  {
-    if ((i = write(1, buf + wrote, len - wrote)) <= 0)
-      return i;
-    wrote += i;
-  } while (wrote < len);
+    sscanf(it->addr, "GPIB%d::%d::%d", &board, &pad, &sad);
+    ud = ibdev(board, pad, sad, ni_tmo(probe_tmo(it)), EOTMODE, EOSMODE);
+    if (ThreadIbsta() & ERR)
+    {
+        it->status = probe_error;
+        return;
+    }
 
-  return len;
+    ibclr(ud);
+    if (!(ThreadIbsta() & ERR))
+        ibwrt(ud, (void *)"*IDN?", 5L);
+    if (!(ThreadIbsta() & ERR))
+        ibrd(ud, r, sizeof(r));
+    if (ThreadIbsta() & ERR)
+        it->status = ThreadIberr() == EABO ? probe_timeout : probe_error;
+    else
+        probe_set_idn(it, (byte *)r, ThreadIbcntl());
+    ibonl(ud, 0);
 }
 
-int read_cmd(byte *buf)
+// Boards are searched in parallel, a board that failed is listed itself.
+int ni_find(probe_item **items)
 {
-  int len;
+    probe_item found[MAX_BOARDS];
+    int n = 0, k, loop;
+
+    if ((boards < 1) || (boards > MAX_BOARDS))
+    {
+        dbg_print("-boards must be 1 to %d\n", MAX_BOARDS);
+        return -1;
+    }
 
-  if (read_exact(buf, 2) != 2)
-    return -1;
-  len = (buf[0] << 8) | buf[1];
-  return read_exact(buf, len);
+    memset(found, 0, sizeof(found));
+    for (k = 0; k < boards; k++)
+    {
+        sprintf(found[k].addr, "GPIB%d", GPIB + k);
+        found[k].group = k;
+    }
+    probe_run(found, boards, ni_find_board);
+
+    *items = (probe_item *)calloc(boards * 31, sizeof(probe_item));
+    if (*items == NULL)
+        return -1;
+    for (k = 0; k < boards; k++)
+    {
+        if (found[k].status != probe_ok)
+        {
+            // listed as it is, not probed as an instrument
+            (*items)[n] = found[k];
+            (*items)[n++].done = true;
+        }
+        for (loop = 0; (found[k].status == probe_ok) && (loop < listeners_n[k]); loop++)
+        {
+            sprintf((*items)[n].addr, "GPIB%d::%d::%d", GPIB + k,
+                    GetPAD(listeners[k][loop]), GetSAD(listeners[k][loop]));
+            (*items)[n].group = probe_group((*items)[n].addr, n);
+            n++;
+        }
+    }
+    return n;
 }
 
-int write_cmd(byte *buf, int len)
-{
-  byte li;
 
-  li = (len >> 8) & 0xff;
-  write_exact(&li, 1);
-  
-  li = len & 0xff;
-  write_exact(&li, 1);
+/*
+ *  After each GPIB call, the application checks whether the call
+ *  succeeded. If an NI-488.2 call fails, the GPIB driver sets the
+ *  corresponding bit in the global status variable. If the call
+ *  failed, this procedure prints an error message, takes the board
+ *  offline and exits.
+ */
+void GPIBCleanup(int ud, const char* ErrorMsg)
+{
+    int err = ThreadIberr();
+    const char *m = "?";
 
-  return write_exact(buf, len);
+    if ((err >= 0) && (err < (int)(sizeof(ErrorMnemonic) / sizeof(ErrorMnemonic[0])))
+        && (ErrorMnemonic[err][0] != '\0'))
+        m = ErrorMnemonic[err];
+    dbg_print("Error : %s\nibsta = 0x%x iberr = %d (%s)\n", ErrorMsg, ThreadIbsta(), err, m);
+    dbg_print("Cleanup: Taking board offline\n");
+    ibnotify(ud, 0, NULL, NULL);    
+    ibonl(ud, 0);
 }
 
-struct gpib_port_comm
+// NI-488.2 backend, dev->addr is "GPIB<board>::<pad>::<sad>"
+
+// Per device state, shared with the ibnotify callback.
+struct ni_state
 {
-    int len;
-    char t;
-    byte *b;
+    volatile bool srq_on;
+    volatile bool io_pending;       // ibrda/ibwrta in flight
 };
 
-bool read_comm_cmd(gpib_port_comm &r)
+int ni_open(gpib_dev *dev)
 {
-    static byte cmd_buf[MAX_COMM_PACK_SIZE];
-    r.len = -1;
-    int len = read_cmd(cmd_buf);
-    if (len < 0)
-        return false;
-    
-    r.t = cmd_buf[0];
-    r.len = len - 1;
-    r.b = cmd_buf + 1;
-    r.b[r.len] = 0;
-    return true;
-}
+    int board = 0, pad = 0, sad = 0;
+    if (sscanf(dev->addr, "GPIB%d::%d::%d", &board, &pad, &sad) < 2)
+        return gpib_error;
 
-bool send_comm_response(const int t, const byte *s, const int len)
-{
-    static byte out_buf[MAX_COMM_PACK_SIZE];
-    if (1 + len > MAX_COMM_PACK_SIZE)
-        return false;
+    dev->priv = calloc(1, sizeof(ni_state));
+    if (dev->priv == NULL)
+        return gpib_error;
 
-    out_buf[0] = t;
-    memcpy(out_buf + 1, s, len);
+    ibconfig(board, IbcAUTOPOLL, 1);
 
-    return write_cmd(out_buf, len + 1) > 0; 
+    dev->ud = ibdev(board, pad, sad, TIMEOUT, EOTMODE, EOSMODE);
+    return ThreadIbsta() & ERR ? gpib_error : gpib_ok;
 }
 
-void send_msg_response(const int t, const char *s)
+int ni_clear(gpib_dev *dev)
 {
-    if (!shutup)
-        send_comm_response(t, (const byte *)s, strlen(s));
+    ibclr(dev->ud);
+    return ni_status(dev);
 }
 
-void help()
+// smallest NI timeout code of at least ms, TNONE for none
+int ni_tmo(long ms)
 {
-    printf("GPIB client command options: \n");
-    printf("    -port               as an Erlang port\n");
-    printf("    -handle <N>         board handle\n");
-    printf("    -pad    <N>         primary address\n");
-    printf("    -sad    <N>         primary address\n");
-    printf("    -ls                 list all instruments on a board and quit\n");
-    printf("    -shutup             suppress all error/debug prints\n");    
-    printf("    -help/-?            show this information\n");
-    printf("Note: Press Enter (empty input) to read device response\n");
+    static const long t[] = {1, 3, 10, 30, 100, 300, 1000, 3000, 10000,
+                             30000, 100000, 300000, 1000000};
+    int i;
+
+    if (ms <= 0)
+        return TNONE;
+    for (i = 0; (i < (int)arr_len(t) - 1) && (t[i] < ms); i++)
+        ;
+    return T1ms + i;
 }
 
-int list_instruments()
+int ni_set_timeout(gpib_dev *dev, long ms)
 {
+    ibtmo(dev->ud, ms > 0 ? ni_tmo(ms) : TIMEOUT);
+    return ThreadIbsta() & ERR ? gpib_error : gpib_ok;
+}
 
-    int        Num_Instruments;            // Number of instruments on GPIB
-    Addr4882_t Instruments[31];            // Array of primary addresses
-    Addr4882_t Result[31];                 // Array of listen addresses
-    instru_info infos[31];
-    int loop;
-
-    SendIFC(GPIB);
-    if (ibsta & ERR)
+// class of NI error err, see gpib_status
+int ni_class(int err)
+{
+    switch (err)
     {
-       GPIBCleanup(GPIB, "Unable to open board");
-       return 1;
+    case EABO:
+        return gpib_timeout;
+    case ENOL:
+        return gpib_no_listener;
+    case EDVR:      // the driver, board or handle is gone
+    case ENEB:
+    case EHDL:
+    case EPWR:
+        return gpib_fatal;
+    default:
+        return gpib_error;
     }
+}
 
-    for (loop = 0; loop < 30; loop++) {
-       Instruments[loop] = (Addr4882_t)(loop + 1);
-    }
-    Instruments[arr_len(Instruments) - 1] = NOADDR;
+int ni_status(gpib_dev *dev)
+{
+    if (!(ThreadIbsta() & ERR))
+        return gpib_ok;
+    dev->code = ThreadIberr();
+    return ni_class(ThreadIberr());
+}
 
-    printf("Finding all instruments on the bus...\n\n");
-    FindLstn(GPIB, Instruments, Result, arr_len(Instruments));
-    if (ibsta & ERR)
-    {
-       GPIBCleanup(GPIB, "Unable to issue FindLstn call");
-       return 1;
-    }
+int ni_write(gpib_dev *dev, const byte *buf, long len, long *cnt)
+{
+    ibwrt(dev->ud, (void *)buf, len);
+    *cnt = ThreadIbcntl();
+    return ni_status(dev);
+}
 
-    Num_Instruments = ibcntl;
-    printf("Number of instruments found = %d\n\n", Num_Instruments);
-    Result[Num_Instruments] = NOADDR;
+int ni_read(gpib_dev *dev, byte *buf, long len, long *cnt)
+{
+    ibrd(dev->ud, buf, len);
+    *cnt = ThreadIbcntl();
+    dev->end = (ThreadIbsta() & END) != 0;
+    return ni_status(dev);
+}
 
-    for (loop = 0; loop < Num_Instruments; loop++)
-    {
-       infos[loop].pad = GetPAD(Result[loop]);
-       infos[loop].sad = GetSAD(Result[loop]);
-    }
-    ibonl(GPIB, 0);
+void ni_close(gpib_dev *dev)
+{
+    ibnotify(dev->ud, 0, NULL, NULL);
+    ibonl(dev->ud, 0);
+    dev->ud = -1;
+    free(dev->priv);
+    dev->priv = NULL;
+}
 
-    for (loop = 0; loop < Num_Instruments; loop++)
-    {
-        int Dev = ibdev(GPIB, infos[loop].pad, infos[loop].sad,
-              TIMEOUT, EOTMODE, EOSMODE);
-        if (ibsta & ERR)
-        {
-           GPIBCleanup(Dev, "Unable to open device");
-           return 1;
-        }
+void ni_cleanup(gpib_dev *dev, const char *msg)
+{
+    GPIBCleanup(dev->ud, msg);
+    free(dev->priv);
+    dev->priv = NULL;
+}
 
-        ibclr(Dev);
-        if (ibsta & ERR)
-        {
-           GPIBCleanup(Dev, "Unable to clear device");
-           return 1;
-        }
+int __stdcall cb_notify(int LocalUd, int LocalIbsta, int LocalIberr, 
+      long LocalIbcntl, void *RefData);
 
-        ibwrt(Dev, (void *)"*IDN?", 5L);
-        if (ibsta & ERR)
-        {
-           GPIBCleanup(Dev, "Unable to write to device");
-           return 1;
-        }
+int ni_notify_mask(ni_state *st)
+{
+    return (st->srq_on ? RQS : 0) | (st->io_pending ? CMPL : 0);
+}
 
-        ibrd(Dev, infos[loop].idn, arr_len(infos[loop].idn) - 1);
-        if (ibsta & ERR)
-        {
-           GPIBCleanup(Dev, "Unable to read data from device");
-           return 1;
-        }
-        infos[loop].idn[ibcntl] = '\0';
-        ibonl(Dev, 0);
-    }
+// (re)arms ibnotify for whatever the device is waiting for
+int ni_arm(gpib_dev *dev)
+{
+    int mask = ni_notify_mask((ni_state *)dev->priv);
+    ibnotify(dev->ud, mask, mask != 0 ? cb_notify : NULL, dev);
+    return ThreadIbsta() & ERR ? gpib_error : gpib_ok;
+}
+
+// RQS needs IbcAUTOPOLL, which ni_open turns on
+int ni_enable_srq(gpib_dev *dev, bool on)
+{
+    ((ni_state *)dev->priv)->srq_on = on;
+    return ni_arm(dev);
+}
+
+// Asynchronous transfers: ibrda/ibwrta return at once and CMPL is
+// reported to cb_notify. io_pending is set after the call, so a CMPL
+// left over from the previous transfer is not taken for this one; if the
+// transfer is already done, ibnotify calls back right away.
+int ni_start_io(gpib_dev *dev)
+{
+    ni_state *st = (ni_state *)dev->priv;
 
-    for (loop = 0; loop < Num_Instruments; loop++)
+    if (ThreadIbsta() & ERR)
+        return ni_status(dev);
+    st->io_pending = true;
+    if (ni_arm(dev) != gpib_ok)
     {
-        if (infos[loop].sad == NO_SAD)
-        {
-            printf("The instrument at %d is %s(PAD = %d, SAD = NONE)\n",
-                   loop + 1, infos[loop].idn, infos[loop].pad);
-        }
-        else
-        {
-            printf("The instrument at %d is %s(PAD = %d, SAD = %d)\n",
-                   loop + 1, infos[loop].idn, infos[loop].pad, infos[loop].sad);
-        }
-    }    
+        st->io_pending = false;
+        ibstop(dev->ud);
+        return gpib_error;
+    }
+    return gpib_ok;
+}
 
-    return 0;
+int ni_write_async(gpib_dev *dev, const byte *buf, long len)
+{
+    ibwrta(dev->ud, (void *)buf, len);
+    return ni_start_io(dev);
 }
 
-void gpib_shutdown(gpib_dev *dev)
+int ni_read_async(gpib_dev *dev, byte *buf, long len)
 {
-    //ibnotify(dev->dev, 0, NULL, NULL);
-    ibonl(dev->dev, 0);
-    dev->dev = -1;
+    ibrda(dev->ud, buf, len);
+    return ni_start_io(dev);
 }
 
-/*
- *  After each GPIB call, the application checks whether the call
- *  succeeded. If an NI-488.2 call fails, the GPIB driver sets the
- *  corresponding bit in the global status variable. If the call
- *  failed, this procedure prints an error message, takes the board
- *  offline and exits.
- */
-void GPIBCleanup(int ud, const char* ErrorMsg)
+// the transfer ends with EABO, reported to cb_notify as a timeout
+int ni_stop(gpib_dev *dev)
 {
-    dbg_print("Error : %s\nibsta = 0x%x iberr = %d (%s)\n",
-               ErrorMsg, ibsta, iberr, ErrorMnemonic[iberr]);
-    dbg_print("Cleanup: Taking board offline\n");
-    ibnotify(ud, 0, NULL, NULL);    
-    ibonl(ud, 0);
+    ibstop(dev->ud);
+    return ThreadIbsta() & ERR ? gpib_error : gpib_ok;
 }
 
+const gpib_backend ni_backend =
+{
+    "ni488",
+    ni_open,
+    ni_clear,
+    ni_write,
+    ni_read,
+    ni_close,
+    ni_cleanup,
+    ni_enable_srq,
+    ni_write_async,
+    ni_read_async,
+    ni_set_timeout,
+    ni_stop
+};
+
 static gpib_dev dev;
 
 BOOL ctrl_handler(DWORD fdwCtrlType) 
@@ -278,6 +384,7 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
     switch (fdwCtrlType) 
     {
         case CTRL_C_EVENT: 
+            close_sessions();
             gpib_shutdown(&dev);
             exit(0);
             return TRUE;
@@ -289,6 +396,7 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
         case CTRL_CLOSE_EVENT: 
         case CTRL_LOGOFF_EVENT: 
         case CTRL_SHUTDOWN_EVENT:
+            close_sessions();
             gpib_shutdown(&dev);
             exit(0);
             return FALSE; 
@@ -298,21 +406,18 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
     } 
 }
 
-int as_port(gpib_dev *dev);
-int interactive(gpib_dev *dev);
-int __stdcall cb_on_rqs(int LocalUd, int LocalIbsta, int LocalIberr, 
-      long LocalIbcntl, void *RefData);
-void stdout_on_receive(const char *s, const int len);
-void port_on_receive(const char *s, const int len);
-
 int main(const int argc, const char *args[])
 {   
-    dev.dev = -1;
+    gpib_dev_init(&dev, &ni_backend);
 
 #define load_i_param(var, param) \
     if (strcmp(args[i], "-"#param) == 0)   \
     {   var = atoi(args[i + 1]); i += 2; }
 
+#define load_s_param(var, param) \
+    if (strcmp(args[i], "-"#param) == 0)   \
+    {   strcpy(var, args[i + 1]); i += 2; }
+
 #define load_b_param(param) \
     if (strcmp(args[i], "-"#param) == 0)   \
     {   param = true; i++; }    
@@ -326,9 +431,34 @@ int main(const int argc, const char *args[])
         else load_i_param(PAD, pad)
         else load_b_param(shutup)
         else load_b_param(port)
-        else if (strcmp(args[i], "-ls") == 0) 
+        else load_b_param(srq)
+        else load_b_param(read_ahead)
+        else load_i_param(coalesce_us, coalesce)
+        else load_i_param(tmo_adapt, tmo_adapt)
+        else load_i_param(tmo_min, tmo_min)
+        else load_i_param(tmo_max, tmo_max)
+        else load_i_param(reconnect_s, reconnect)
+        else load_i_param(packet_bytes, packet)
+        else load_i_param(max_frame, max_frame)
+        else load_i_param(read_size, rdsize)
+        else load_i_param(out_buf_size, outbuf)
+        else load_i_param(flush_us, flush_us)
+        else load_i_param(proto, proto)
+        else load_i_param(trace_level, trace)
+        else load_b_param(ls)
+        else load_s_param(inv_path, cache)
+        else load_i_param(boards, boards)
+        else load_i_param(probe_ms, probe_ms)
+        else load_i_param(probe_jobs, ls_jobs)
+        else if (strcmp(args[i], "-json") == 0)
+        {
+            probe_json = true;
+            i++;
+        }
+        else if (strcmp(args[i], "-refresh") == 0)
         {
-            return list_instruments();
+            probe_refresh = true;
+            i++;
         }
         else if ((strcmp(args[i], "-help") == 0) || (strcmp(args[i], "-?") == 0))
         {
@@ -339,22 +469,23 @@ int main(const int argc, const char *args[])
             i++;
     }
 
+    if (ls)
+        return probe_scan(ni_find, ni_probe);
+
     if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)ctrl_handler, TRUE))
         dbg_print("WARNING: SetConsoleCtrlHandler failed.\n");
 
-    ibconfig(GPIB, IbcAUTOPOLL, 1);
+    sprintf(dev.addr, "GPIB%d::%d::%d", GPIB, PAD, SAD);
 
-    dev.dev = ibdev(GPIB, PAD, SAD, TIMEOUT, EOTMODE, EOSMODE);
-    if (ibsta & ERR)
+    if (dev.be->open(&dev) != gpib_ok)
     {
-       GPIBCleanup(dev.dev, "Unable to open device");
+       dev.be->cleanup(&dev, "Unable to open device");
        return 1;
     }    
 
-    ibclr(dev.dev);
-    if (ibsta & ERR)
+    if (dev.be->clear(&dev) != gpib_ok)
     {
-       GPIBCleanup(dev.dev, "Unable to clear device");
+       dev.be->cleanup(&dev, "Unable to clear device");
        return 1;
     }
 
@@ -363,18 +494,16 @@ int main(const int argc, const char *args[])
         dev.on_receive = port_on_receive;
 
     // set up the asynchronous event notification on RQS
-    // ibnotify(dev.dev, RQS | TIMO, cb_on_rqs, &dev);
-    // if (ibsta & ERR)  
-    // {
-    //     GPIBCleanup(dev.dev, "ibnotify call failed.\n");
-    //     return 0;
-    // }
+    if (srq && (port_enable_srq(&dev, true) != gpib_ok))
+    {
+        GPIBCleanup(dev.ud, "ibnotify call failed.\n");
+        return 1;
+    }
 
     if (port)
     {
-        setmode(0, O_BINARY);
-        setmode(1, O_BINARY);
-        return as_port(&dev);
+        set_binary_stdio();
+        return as_port(&ni_backend, &dev);
     }
     else
     {
@@ -384,156 +513,82 @@ int main(const int argc, const char *args[])
     }
 }
 
-int port_read(gpib_dev *dev)
-{
-    char s[3240 + 1];
-    ibrd(dev->dev, s, sizeof(s) - 1); 
-    send_msg_response(command_dbg_msg, "ibrd");
-    if (ibsta & ERR)
-    {
-        if (iberr == EABO)
-            return 0;
-        GPIBCleanup(dev->dev, "Unable to read data from device");
-        return 1;
-    }
-    send_msg_response(command_dbg_msg, "send_ ing");
-    send_comm_response(command_read_from_gpib, (byte *)s, ibcntl);
-    return 0;
-}
-
-int as_port(gpib_dev *dev)
-{
-    char s[3240 + 1]; send_msg_response(command_dbg_msg, "as_port");
-    while (true)
-    {
-        gpib_port_comm c;
-        send_msg_response(command_dbg_msg, "wait for command");
-        read_comm_cmd(c);
-        send_msg_response(command_dbg_msg, "read_comm_cmd");
-        switch (c.t)
-        {
-        case command_write_to_gpib:
-            send_msg_response(command_dbg_msg, "command_write_to_gpib");
-            if (c.len < 1) 
-                continue;
-
-            ibwrt(dev->dev, c.b, c.len);
-            if (ibsta & ERR)
-            {
-               GPIBCleanup(dev->dev, "Unable to write to device");
-               return 1;
-            }
-
-            break;
-        case command_read_from_gpib:
-            send_msg_response(command_dbg_msg, "command_read_from_gpib");
-
-            if (port_read(dev) != 0)
-                return 1;
-            break;
-        default:
-            gpib_shutdown(dev);
-            return 0;
-        }
-
-        
-    }
-}
-
-int interactive(gpib_dev *dev)
-{
-    while (true)
-    {
-        char s[10240 + 1];
-
-        s[0] = '\0';
-        gets(s);
-        if (strlen(s) >= sizeof(s) - 1)
-        {
-            gpib_shutdown(dev);
-            break;
-        }
-
-        if (strlen(s) > 0)
-        {
-            ibwrt(dev->dev, s, strlen(s));
-            if (ibsta & ERR)
-            {
-               GPIBCleanup(dev->dev, "Unable to write to device");
-               return 1;
-            }
-        }
-        else    // strlen(s) = 0, read response
-        {
-            ibrd(dev->dev, s, sizeof(s) - 1);
-            if (ibsta & ERR)
-            {
-                if (iberr == EABO) continue;
-                GPIBCleanup(dev->dev, "Unable to read data from device");
-                return 1;
-            }
-            s[ibcntl] = '\n'; s[ibcntl + 1] = '\0';
-            printf(s);
-        }
-    }
-}
-
-void stdout_on_receive(const char *s, const int len)
-{
-    printf(s);
-}
-
-void port_on_receive(const char *s, const int len)
-{
-    send_comm_response(command_read_from_gpib, (const byte *)s, len);
-}
-
-int __stdcall cb_on_rqs(int LocalUd, int LocalIbsta, int LocalIberr, 
+/*
+ *  Runs on a driver thread: it must not touch the port, so everything,
+ *  errors included, is handed to dev->on_receive. The thread specific
+ *  copies of ibsta/ibcntl are used as the main thread may be busy with
+ *  another device. Returns 0 if service requests have to be turned off.
+ */
+int cb_on_rqs(int LocalUd, int LocalIbsta, int LocalIberr, 
       long LocalIbcntl, void *RefData)
 {
     gpib_dev *dev = (gpib_dev *)(RefData);
 
-#define fatal_error(s)  \
-    {                   \
-        GPIBCleanup(dev->dev, s); \
-        exit(-1);                   \
-    } while (false)   
-
-#define expectedResponse 0x43
+#define srq_error()  \
+    do {                \
+        dev->on_receive(dev, 0, NULL, -1); \
+        return 0;                   \
+    } while (false)
 
    char SpollByte;
-   char ReadBuffer[4000];
+   byte *ReadBuffer;
+   long cnt;
 
-   // If the ERR bit is set in LocalIbsta, then print an error message 
-   // and return.
+   // If the ERR bit is set in LocalIbsta, then report it and stop the
+   // callbacks.
    if (LocalIbsta & ERR)  {
-      fatal_error("GPIB error has occurred. No more callbacks.");
+      srq_error();
    }
    
-   // Read the serial poll byte from the device. If the ERR bit is set
-   // in ibsta, then print an error message and return.
+   // Read the serial poll byte from the device.
    LocalIbsta = ibrsp(LocalUd, &SpollByte);
    if (LocalIbsta & ERR)  {
-      fatal_error("GPIB error has occurred. No more callbacks.");
+      srq_error();
    }
 
-   // If the returned status byte equals the expected response, then 
-   // the device has valid data to send; otherwise it has a fault 
-   // condition to report.
-   //if (SpollByte != expectedResponse)   {
-   //   fatal_error("GPIB error has occurred. No more callbacks.");
-   // }
-
-   // Read the data from the device. If the ERR bit is set in ibsta, 
-   // then print an error message and return.
-   LocalIbsta = ibrd(LocalUd, ReadBuffer, sizeof(ReadBuffer) - 1);
-   if (LocalIbsta & ERR)  {
-      fatal_error("GPIB error has occurred. No more callbacks.");
+   // Read the data from the device.
+   ReadBuffer = (byte *)malloc(read_size);
+   if (ReadBuffer == NULL)  {
+      srq_error();
+   }
+   LocalIbsta = ibrd(LocalUd, ReadBuffer, read_size);
+   cnt = ThreadIbcntl();
+   if ((LocalIbsta & ERR) && (ThreadIberr() != EABO))  {
+      free(ReadBuffer);
+      srq_error();
    }
 
-   ReadBuffer[ibcntl] = '\0';
-   dev->on_receive(ReadBuffer, ibcntl);
+   dev->on_receive(dev, (byte)SpollByte, ReadBuffer, LocalIbsta & ERR ? 0 : cnt);
+   free(ReadBuffer);
 
    return RQS;
 }
 
+// ibnotify callback for both the end of a transfer and service requests
+int __stdcall cb_notify(int LocalUd, int LocalIbsta, int LocalIberr, 
+      long LocalIbcntl, void *RefData)
+{
+    gpib_dev *dev = (gpib_dev *)(RefData);
+    ni_state *st = (ni_state *)dev->priv;
+    int status;
+
+    if ((LocalIbsta & CMPL) && st->io_pending)
+    {
+        st->io_pending = false;
+        dev->end = (LocalIbsta & END) != 0;
+        status = gpib_ok;
+        if (LocalIbsta & ERR)
+        {
+            dev->code = LocalIberr;
+            status = ni_class(LocalIberr);
+        }
+        dev->on_complete(dev, status, LocalIbcntl);
+        LocalIbsta &= ~ERR;
+    }
+
+    if ((LocalIbsta & RQS) && st->srq_on
+        && (cb_on_rqs(LocalUd, LocalIbsta, LocalIberr, LocalIbcntl, RefData) == 0))
+        st->srq_on = false;
+
+    return ni_notify_mask(st);
+}
@@ -0,0 +1,610 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpib_port.h"
+#include "trace.h"
+#include "probe.h"
+
+// Simulated SCPI instrument, used to benchmark the port loop without
+// a bus card.
+//
+// A write ending with '?' queues a response: the IDN string for *IDN?,
+// otherwise a comma separated list of numbers of resp_size bytes. A read
+// with nothing queued times out, like a real instrument would. CURV? and
+// DATA? queries answer with an IEEE 488.2 block of resp_size bytes, *TST?
+// with "0" once its self test of -tst ms has run. With
+// service requests enabled, a queued response is pushed after the
+// transfer delay instead, with MAV and RQS set in the status byte.
+// Asynchronous transfers run on a worker thread, like a driver would.
+
+long sim_rate       = 0;         // bytes per second, 0 = infinite
+long sim_latency    = 0;         // per transaction latency (us)
+long sim_resp_size  = 64;        // response size of a generic query
+long sim_tmo        = 100;       // simulated timeout (ms)
+long sim_tmo_every  = 0;         // inject a timeout every N reads, 0 = never
+long sim_tst        = 0;         // *TST? self test time (ms)
+long sim_err_every  = 0;         // fail every N transfers, 0 = never
+char sim_err[16]    = "bus";     // with a bus error, no listener ("nol")
+                                 // or by losing the session ("fatal")
+long sim_down       = 0;         // ms a lost session cannot be opened
+static u64 sim_down_until = 0;
+char sim_idn[200]   = "KissGPIB,Simulated Instrument,0,1.0";
+
+struct sim_state
+{
+    byte *resp;                  // pending response
+    long resp_len;
+    long resp_pos;
+    long reads;
+    u64 ready_at;                // the response is there from then on
+    long xfers;                  // transfers, for -err_every
+    bool lost;                   // failed with "fatal", until reopened
+    long tmo_ms;                 // set_timeout, 0 = sim_tmo
+
+    lock_t lock;                 // the SRQ thread shares the response
+    volatile bool srq_on;
+    event_t srq_kick;
+    event_t srq_done;
+
+    volatile bool io_on;         // the worker thread runs
+    event_t io_kick;
+    event_t io_exit;
+    bool io_write;
+    byte *io_buf;                // transfer to run, NULL when idle
+    long io_len;
+    volatile bool io_stop;       // sim_stop, ends the waits of a read
+    event_t io_wake;
+};
+
+#define STB_SRQ 0x50             // MAV | RQS
+
+void sim_transfer_delay(long len)
+{
+    u64 us = sim_latency;
+    if (sim_rate > 0)
+        us += (u64)len * 1000000 / sim_rate;
+    sleep_us(us);
+}
+
+void sim_make_response(sim_state *st, const byte *cmd, long len)
+{
+    long i;
+
+    st->ready_at = 0;
+    if ((len == 5) && (memcmp(cmd, "*IDN?", 5) == 0))
+    {
+        st->resp_len = strlen(sim_idn) + 1;
+        st->resp = (byte *)realloc(st->resp, st->resp_len);
+        memcpy(st->resp, sim_idn, st->resp_len - 1);
+    }
+    else if ((len == 5) && (memcmp(cmd, "*TST?", 5) == 0))
+    {
+        st->resp_len = 2;
+        st->resp = (byte *)realloc(st->resp, st->resp_len);
+        st->resp[0] = '0';
+        st->ready_at = now_us() + (u64)sim_tst * 1000;
+    }
+    else if ((len >= 5) && ((memcmp(cmd + len - 5, "CURV?", 5) == 0)
+                           || (memcmp(cmd + len - 5, "DATA?", 5) == 0)))
+    {
+        char h[24];
+        long n = sim_resp_size > 0 ? sim_resp_size : 0;
+        long hl;
+
+        sprintf(h + 2, "%ld", n);
+        hl = strlen(h + 2);
+        h[0] = '#';
+        h[1] = '0' + hl;
+        hl += 2;
+        st->resp_len = hl + n + 1;
+        st->resp = (byte *)realloc(st->resp, st->resp_len);
+        memcpy(st->resp, h, hl);
+        for (i = 0; i < n; i++)
+            st->resp[hl + i] = (byte)i;
+    }
+    else
+    {
+        static const char v[] = "+1.23456789E-03,";
+        st->resp_len = sim_resp_size > 0 ? sim_resp_size : 1;
+        st->resp = (byte *)realloc(st->resp, st->resp_len);
+        for (i = 0; i < st->resp_len - 1; i++)
+            st->resp[i] = v[i % (sizeof(v) - 1)];
+    }
+    st->resp[st->resp_len - 1] = '\n';
+    st->resp_pos = 0;
+}
+
+int sim_open(gpib_dev *dev)
+{
+    sim_state *st;
+
+    if (now_us() < sim_down_until)
+        return gpib_fatal;
+    st = (sim_state *)calloc(1, sizeof(sim_state));
+    if (st == NULL)
+        return gpib_error;
+    lock_init(&st->lock);
+    event_init(&st->srq_kick);
+    event_init(&st->srq_done);
+    event_init(&st->io_kick);
+    event_init(&st->io_exit);
+    event_init(&st->io_wake);
+    dev->priv = st;
+    dev->ud = 0;
+    return gpib_ok;
+}
+
+// the failure injected by -err_every into this transfer, gpib_ok if none
+int sim_fail(gpib_dev *dev, sim_state *st)
+{
+    int status = gpib_error;
+
+    if (st->lost)
+        return gpib_fatal;
+    if ((sim_err_every <= 0) || (++st->xfers % sim_err_every != 0))
+        return gpib_ok;
+    if (strcmp(sim_err, "nol") == 0)
+        status = gpib_no_listener;
+    else if (strcmp(sim_err, "fatal") == 0)
+        status = gpib_fatal;
+    st->lost = status == gpib_fatal;
+    if (st->lost)
+        sim_down_until = now_us() + (u64)sim_down * 1000;
+    dev->code = status;
+    return status;
+}
+
+int sim_clear(gpib_dev *dev)
+{
+    sim_state *st = (sim_state *)dev->priv;
+    if (st->lost)
+        return gpib_fatal;
+    lock_enter(&st->lock);
+    st->resp_len = 0;
+    st->resp_pos = 0;
+    lock_leave(&st->lock);
+    sim_transfer_delay(0);
+    return gpib_ok;
+}
+
+int sim_write(gpib_dev *dev, const byte *buf, long len, long *cnt)
+{
+    sim_state *st = (sim_state *)dev->priv;
+    long n = len;
+    int status = sim_fail(dev, st);
+
+    *cnt = 0;
+    if (status != gpib_ok)
+        return status;
+    while ((n > 0) && ((buf[n - 1] == '\n') || (buf[n - 1] == '\r')))
+        n--;
+
+    sim_transfer_delay(len);
+    if ((n > 0) && (buf[n - 1] == '?'))
+    {
+        lock_enter(&st->lock);
+        sim_make_response(st, buf, n);
+        lock_leave(&st->lock);
+        if (st->srq_on)
+            event_set(&st->srq_kick);
+    }
+    *cnt = len;
+    return gpib_ok;
+}
+
+// sleeps for us, false if sim_stop ended it first
+bool sim_wait(sim_state *st, u64 us)
+{
+    u64 end = now_us() + us, now;
+
+    while (!st->io_stop && ((now = now_us()) < end))
+        event_wait(&st->io_wake, (long)((end - now + 999) / 1000));
+    return !st->io_stop;
+}
+
+int sim_read(gpib_dev *dev, byte *buf, long len, long *cnt)
+{
+    sim_state *st = (sim_state *)dev->priv;
+    u64 tmo = (u64)(st->tmo_ms > 0 ? st->tmo_ms : sim_tmo) * 1000, now, left;
+    long n;
+    int status = sim_fail(dev, st);
+
+    *cnt = 0;
+    if (status != gpib_ok)
+        return status;
+    lock_enter(&st->lock);
+    st->reads++;
+    if ((st->resp_pos >= st->resp_len)
+        || ((sim_tmo_every > 0) && (st->reads % sim_tmo_every == 0)))
+    {
+        lock_leave(&st->lock);
+        sim_wait(st, tmo);
+        return gpib_timeout;
+    }
+    now = now_us();
+    if (st->ready_at > now)
+    {
+        // still busy with the command
+        lock_leave(&st->lock);
+        left = st->ready_at - now;
+        if (!sim_wait(st, left < tmo ? left : tmo) || (left > tmo))
+            return gpib_timeout;
+        lock_enter(&st->lock);
+    }
+
+    n = st->resp_len - st->resp_pos;
+    if (n > len)
+        n = len;
+    memcpy(buf, st->resp + st->resp_pos, n);
+    st->resp_pos += n;
+    dev->end = st->resp_pos >= st->resp_len;
+    lock_leave(&st->lock);
+    sim_transfer_delay(n);
+    *cnt = n;
+    return gpib_ok;
+}
+
+void sim_srq_wait(void *arg)
+{
+    gpib_dev *dev = (gpib_dev *)arg;
+    sim_state *st = (sim_state *)dev->priv;
+    byte *data = NULL;
+    long n;
+
+    while (st->srq_on)
+    {
+        if (!event_wait(&st->srq_kick, 200) || !st->srq_on)
+            continue;
+
+        lock_enter(&st->lock);
+        n = st->resp_len - st->resp_pos;
+        if (n > 0)
+        {
+            data = (byte *)realloc(data, n);
+            memcpy(data, st->resp + st->resp_pos, n);
+            st->resp_pos = st->resp_len;
+        }
+        lock_leave(&st->lock);
+
+        if (n > 0)
+        {
+            sim_transfer_delay(n);
+            dev->on_receive(dev, STB_SRQ, data, n);
+        }
+    }
+    free(data);
+    event_set(&st->srq_done);
+}
+
+int sim_enable_srq(gpib_dev *dev, bool on)
+{
+    sim_state *st = (sim_state *)dev->priv;
+
+    if (st->srq_on == on)
+        return gpib_ok;
+    st->srq_on = on;
+    if (on)
+    {
+        if (!thread_start(sim_srq_wait, dev))
+        {
+            st->srq_on = false;
+            return gpib_error;
+        }
+    }
+    else
+    {
+        event_set(&st->srq_kick);
+        event_wait(&st->srq_done, -1);
+    }
+    return gpib_ok;
+}
+
+void sim_io_worker(void *arg)
+{
+    gpib_dev *dev = (gpib_dev *)arg;
+    sim_state *st = (sim_state *)dev->priv;
+    long cnt;
+    int status;
+
+    while (st->io_on)
+    {
+        if (!event_wait(&st->io_kick, 200) || (st->io_buf == NULL))
+            continue;
+
+        status = st->io_write ? sim_write(dev, st->io_buf, st->io_len, &cnt)
+                              : sim_read(dev, st->io_buf, st->io_len, &cnt);
+        st->io_buf = NULL;
+        dev->on_complete(dev, status, cnt);
+    }
+    event_set(&st->io_exit);
+}
+
+int sim_start_io(gpib_dev *dev, bool wr, byte *buf, long len)
+{
+    sim_state *st = (sim_state *)dev->priv;
+
+    if (!st->io_on)
+    {
+        st->io_on = true;
+        if (!thread_start(sim_io_worker, dev))
+        {
+            st->io_on = false;
+            return gpib_error;
+        }
+    }
+    st->io_write = wr;
+    st->io_stop = false;
+    st->io_len = len;
+    st->io_buf = buf;
+    event_set(&st->io_kick);
+    return gpib_ok;
+}
+
+int sim_write_async(gpib_dev *dev, const byte *buf, long len)
+{
+    return sim_start_io(dev, true, (byte *)buf, len);
+}
+
+int sim_read_async(gpib_dev *dev, byte *buf, long len)
+{
+    return sim_start_io(dev, false, buf, len);
+}
+
+int sim_stop(gpib_dev *dev)
+{
+    sim_state *st = (sim_state *)dev->priv;
+    st->io_stop = true;
+    event_set(&st->io_wake);
+    return gpib_ok;
+}
+
+int sim_set_timeout(gpib_dev *dev, long ms)
+{
+    ((sim_state *)dev->priv)->tmo_ms = ms > 0 ? ms : 0;
+    return gpib_ok;
+}
+
+void sim_close(gpib_dev *dev)
+{
+    sim_state *st = (sim_state *)dev->priv;
+    if (st != NULL)
+    {
+        sim_enable_srq(dev, false);
+        if (st->io_on)
+        {
+            st->io_on = false;
+            event_set(&st->io_kick);
+            event_wait(&st->io_exit, -1);
+        }
+        free(st->resp);
+        free(st);
+    }
+    dev->priv = NULL;
+    dev->ud = -1;
+}
+
+void sim_cleanup(gpib_dev *dev, const char *msg)
+{
+    dbg_print("Error : %s\n", msg);
+    sim_close(dev);
+}
+
+const gpib_backend sim_backend =
+{
+    "sim",
+    sim_open,
+    sim_clear,
+    sim_write,
+    sim_read,
+    sim_close,
+    sim_cleanup,
+    sim_enable_srq,
+    sim_write_async,
+    sim_read_async,
+    sim_set_timeout,
+    sim_stop
+};
+
+#define SIM_LS_COUNT 8
+
+bool ls = false;
+
+// -ls: instrument SIM<k>::INSTR answers *IDN? after the transfer delays,
+// every -tmo_every one is dead and times out
+void sim_probe(probe_item *it)
+{
+    gpib_dev d;
+    byte r[256];
+    long cnt = 0;
+    int k = 0;
+
+    sscanf(it->addr, "SIM%d", &k);
+    if ((sim_tmo_every > 0) && ((k + 1) % sim_tmo_every == 0))
+    {
+        sleep_us((u64)(sim_tmo < probe_tmo(it) ? sim_tmo : probe_tmo(it)) * 1000);
+        it->status = probe_timeout;
+        return;
+    }
+
+    gpib_dev_init(&d, &sim_backend);
+    strcpy(d.addr, it->addr);
+    if (sim_open(&d) != gpib_ok)
+    {
+        it->status = probe_error;
+        return;
+    }
+    sim_set_timeout(&d, probe_tmo(it));
+    sim_write(&d, (const byte *)"*IDN?", 5, &cnt);
+    if (sim_read(&d, r, sizeof(r), &cnt) == gpib_ok)
+        probe_set_idn(it, r, cnt);
+    else
+        it->status = probe_timeout;
+    sim_close(&d);
+}
+
+int sim_find(probe_item **items)
+{
+    int k;
+
+    *items = (probe_item *)calloc(SIM_LS_COUNT, sizeof(probe_item));
+    if (*items == NULL)
+        return -1;
+    for (k = 0; k < SIM_LS_COUNT; k++)
+    {
+        sprintf((*items)[k].addr, "SIM%d::INSTR", k);
+        (*items)[k].group = probe_group((*items)[k].addr, k);
+    }
+    return SIM_LS_COUNT;
+}
+
+void help()
+{
+    printf("GPIB client command options (simulated instrument): \n");
+    printf("    -port               as an Erlang port\n");
+    printf("    -packet <2|4>       port length prefix, as Erlang {packet, N}\n");
+    printf("    -max_frame <N>      max frame size with -packet 4\n");
+    printf("    -rdsize <N>         max bytes of one device read\n");
+    printf("    -outbuf <N>         batch output frames in N bytes, 0 = off\n");
+    printf("    -flush_us <N>       max time a frame is held back (us)\n");
+    printf("    -proto  <1|2|3>     port protocol, 2 adds request ids, 3 sessions\n");
+    printf("    -rate   <N>         transfer rate in bytes/s, 0 = infinite\n");
+    printf("    -latency <N>        per transaction latency in us\n");
+    printf("    -resp   <N>         response size of a generic query\n");
+    printf("    -tmo    <N>         simulated timeout in ms\n");
+    printf("    -tmo_every <N>      inject a timeout every N reads\n");
+    printf("    -tst    <N>         *TST? self test time in ms\n");
+    printf("    -err_every <N>      fail every N transfers, 0 = never\n");
+    printf("    -err    <Kind>      of the failure: bus, nol or fatal\n");
+    printf("    -down   <N>         ms a lost session cannot be opened\n");
+    printf("    -idn    <Str>       *IDN? response\n");
+    printf("    -srq                push data on service requests\n");
+    printf("    -ls                 list %d simulated instruments and quit\n", SIM_LS_COUNT);
+    printf("    -probe_ms <N>       (-ls) timeout of one *IDN? probe in ms\n");
+    printf("    -ls_jobs <N>        (-ls) max probes at a time\n");
+    printf("    -json               (-ls) print the list as JSON\n");
+    printf("    -cache  <File>      inventory cache, keeps the learned timeouts\n");
+    printf("    -refresh            (-ls) search the bus and rewrite the cache\n");
+    printf("    -read_ahead         read the response of a query write right away\n");
+    printf("    -coalesce <N>       join writes arriving within N us, 0 = off\n");
+    printf("    -tmo_adapt <N>      read timeout N x p99 of the answers, 0 = off\n");
+    printf("    -tmo_min <N>        least adaptive timeout in ms\n");
+    printf("    -tmo_max <N>        most adaptive timeout in ms\n");
+    printf("    -reconnect <N>      keep reopening a lost session for N s\n");
+    printf("    -trace  <N>         trace level, 0 off, 1 error, 2 info, 3 debug\n");
+    printf("    -shutup             suppress all error/debug prints\n");
+    printf("    -help/-?            show this information\n");
+    printf("Note: Press Enter (empty input) to read device response\n");
+}
+
+static gpib_dev dev;
+
+int main(const int argc, const char *args[])
+{
+    gpib_dev_init(&dev, &sim_backend);
+
+#define load_i_param(var, param) \
+    if (strcmp(args[i], "-"#param) == 0)   \
+    {   var = atol(args[i + 1]); i += 2; }
+
+#define load_s_param(var, param) \
+    if (strcmp(args[i], "-"#param) == 0)   \
+    {   strcpy(var, args[i + 1]); i += 2; }
+
+#define load_b_param(param) \
+    if (strcmp(args[i], "-"#param) == 0)   \
+    {   param = true; i++; }
+
+
+    int i = 1;
+    while (i < argc)
+    {
+        load_i_param(sim_rate, rate)
+        else load_i_param(sim_latency, latency)
+        else load_i_param(sim_resp_size, resp)
+        else load_i_param(sim_tmo, tmo)
+        else load_i_param(sim_tmo_every, tmo_every)
+        else load_i_param(sim_tst, tst)
+        else load_i_param(sim_err_every, err_every)
+        else load_s_param(sim_err, err)
+        else load_i_param(sim_down, down)
+        else load_s_param(sim_idn, idn)
+        else load_b_param(shutup)
+        else load_b_param(port)
+        else load_b_param(srq)
+        else load_b_param(read_ahead)
+        else load_i_param(coalesce_us, coalesce)
+        else load_i_param(tmo_adapt, tmo_adapt)
+        else load_i_param(tmo_min, tmo_min)
+        else load_i_param(tmo_max, tmo_max)
+        else load_i_param(reconnect_s, reconnect)
+        else load_i_param(packet_bytes, packet)
+        else load_i_param(max_frame, max_frame)
+        else load_i_param(read_size, rdsize)
+        else load_i_param(out_buf_size, outbuf)
+        else load_i_param(flush_us, flush_us)
+        else load_i_param(proto, proto)
+        else load_i_param(trace_level, trace)
+        else load_b_param(ls)
+        else load_s_param(inv_path, cache)
+        else load_i_param(probe_ms, probe_ms)
+        else load_i_param(probe_jobs, ls_jobs)
+        else if (strcmp(args[i], "-json") == 0)
+        {
+            probe_json = true;
+            i++;
+        }
+        else if (strcmp(args[i], "-refresh") == 0)
+        {
+            probe_refresh = true;
+            i++;
+        }
+        else if ((strcmp(args[i], "-help") == 0) || (strcmp(args[i], "-?") == 0))
+        {
+            help();
+            return -1;
+        }
+        else
+            i++;
+    }
+
+    if (ls)
+        return probe_scan(sim_find, sim_probe);
+
+    strcpy(dev.addr, "SIM0::INSTR");
+
+    if (dev.be->open(&dev) != gpib_ok)
+    {
+       dev.be->cleanup(&dev, "Unable to open device");
+       return 1;
+    }
+
+    if (dev.be->clear(&dev) != gpib_ok)
+    {
+       dev.be->cleanup(&dev, "Unable to clear device");
+       return 1;
+    }
+
+    dev.on_receive = stdout_on_receive;
+    if (port)
+        dev.on_receive = port_on_receive;
+
+    if (srq && (port_enable_srq(&dev, true) != gpib_ok))
+    {
+       dev.be->cleanup(&dev, "Unable to set up service requests");
+       return 1;
+    }
+
+    if (port)
+    {
+        set_binary_stdio();
+        return as_port(&sim_backend, &dev);
+    }
+    else
+    {
+        if (!shutup)
+            printf("Tip: Press Enter to read response\n");
+        return interactive(&dev);
+    }
+}
@@ -8,8 +8,9 @@
 
 #include <windows.h>
 #include "visa.h"
-
-#define arr_len(x) (sizeof(x) / sizeof(x[0]))
+#include "gpib_port.h"
+#include "trace.h"
+#include "probe.h"
 
 // TCP-IP instrument
 int board = 0;                 // board index
@@ -21,261 +22,418 @@ int handle = 0;
 int pad = -1;
 int sad = -1;
 
-bool shutup = false;
-bool port   = false;
-
-typedef void (* f_on_receive)(const char *str, const int len);
+ViSession rm = VI_NULL;          // default resource manager
+int rm_users = 0;                // sessions sharing rm
+static lock_t rm_lock;           // rm and rm_users, see visa_open
+static bool rm_inited = false;
 
-struct gpib_dev
+void help()
 {
-    char addr[500];
-    ViSession rm;
-    ViSession dev;
-    f_on_receive on_receive;
-};
-
-void GPIBCleanup(int ud, const char* ErrorMsg);
+    printf("GPIB client command options: \n");
+    printf("    -port               as an Erlang port\n");
+    printf("    -packet <2|4>       port length prefix, as Erlang {packet, N}\n");
+    printf("    -max_frame <N>      max frame size with -packet 4\n");
+    printf("    -rdsize <N>         max bytes of one device read\n");
+    printf("    -outbuf <N>         batch output frames in N bytes, 0 = off\n");
+    printf("    -flush_us <N>       max time a frame is held back (us)\n");
+    printf("    -proto  <1|2|3>     port protocol, 2 adds request ids, 3 sessions\n");
+    printf("    -board  <N>         (LAN) board index \n");
+    printf("    -ip     'IP addr'   (LAN) IP address string\n");
+    printf("    -name   <Name>      (LAN) device name\n");
+    printf("    -gpib   <N>         (GPIB) board handle \n");
+    printf("    -pad    <N>         (GPIB) primary address\n");
+    printf("    -sad    <N>         (GPIB) secondery address\n");
+    printf("    -ls                 list all instruments on a board and quit\n");
+    printf("    -probe_ms <N>       (-ls) timeout of one *IDN? probe in ms\n");
+    printf("    -ls_jobs <N>        (-ls) max probes at a time\n");
+    printf("    -json               (-ls) print the list as JSON\n");
+    printf("    -cache  <File>      inventory cache, keeps the learned timeouts\n");
+    printf("    -refresh            (-ls) search the bus and rewrite the cache\n");
+    printf("    -srq                push data on service requests\n");
+    printf("    -read_ahead         read the response of a query write right away\n");
+    printf("    -coalesce <N>       join writes arriving within N us, 0 = off\n");
+    printf("    -tmo_adapt <N>      read timeout N x p99 of the answers, 0 = off\n");
+    printf("    -tmo_min <N>        least adaptive timeout in ms\n");
+    printf("    -tmo_max <N>        most adaptive timeout in ms\n");
+    printf("    -reconnect <N>      keep reopening a lost session for N s\n");
+    printf("    -trace  <N>         trace level, 0 off, 1 error, 2 info, 3 debug\n");
+    printf("    -shutup             suppress all error/debug prints\n");    
+    printf("    -help/-?            show this information\n");
+    printf("Note: Press Enter (empty input) to read device response\n");
+}
 
-//#define dbg_print(...) if (!shutup) fprintf(stderr, __VA_ARGS__)
-#define dbg_print(s) if (!shutup) fprintf(stderr, s)
+bool ls = false;
+static ViSession probe_rm = VI_NULL;
 
-#define MAX_COMM_PACK_SIZE 65536
+// *IDN? to one resource, with the probe timeout
+void visa_probe(probe_item *it)
+{
+    ViSession instr;
+    ViUInt32 retCount = 0;
+    ViStatus status;
+    char r[256];
 
-#define command_write_to_gpib       0
-#define command_read_from_gpib      1
-#define command_dbg_msg             2
-#define command_shutdown            3
+    status = viOpen(probe_rm, it->addr, VI_NULL, (ViUInt32)probe_tmo(it), &instr);
+    if (status < VI_SUCCESS)
+    {
+        it->status = status == VI_ERROR_TMO ? probe_timeout : probe_error;
+        return;
+    }
+    viSetAttribute(instr, VI_ATTR_TMO_VALUE, (ViAttrState)probe_tmo(it));
+    status = viWrite(instr, (ViBuf)"*IDN?\n", 6, &retCount);
+    if (status >= VI_SUCCESS)
+        status = viRead(instr, (ViBuf)r, sizeof(r), &retCount);
+    if (status < VI_SUCCESS)
+        it->status = status == VI_ERROR_TMO ? probe_timeout : probe_error;
+    else
+        probe_set_idn(it, (byte *)r, retCount);
+    viClose(instr);
+}
 
-int read_exact(byte *buf, int len)
+// All instruments the resource manager knows of are probed in parallel,
+// except those on the same GPIB board, which share its bus. Serial ports
+// and the like are listed without a probe.
+int visa_find(probe_item **items)
 {
-  int i, got=0;
+    char instrDescriptor[VI_FIND_BUFLEN];
+    ViUInt32 numInstrs = 0, i;
+    ViFindList findList = VI_NULL;
+    ViStatus status;
+
+    status = viFindRsrc(probe_rm, "?*INSTR", &findList, &numInstrs, instrDescriptor);
+    if (status < VI_SUCCESS)
+        numInstrs = 0;
 
-  do 
-  {
-    if ((i = read(0, buf + got, len - got)) <= 0)
-      return i;
-    got += i;
-  } while (got < len);
+    *items = (probe_item *)calloc(numInstrs > 0 ? numInstrs : 1, sizeof(probe_item));
+    if (*items == NULL)
+        return -1;
+    for (i = 0; i < numInstrs; i++)
+    {
+        probe_item *it = &(*items)[i];
 
-  return len;
+        if ((i > 0) && (viFindNext(findList, instrDescriptor) < VI_SUCCESS))
+            break;
+        strncpy(it->addr, instrDescriptor, sizeof(it->addr) - 1);
+        it->group = probe_group(it->addr, i);
+        if ((strncmp(instrDescriptor, "GPIB", 4) != 0)
+            && (strncmp(instrDescriptor, "TCPIP", 5) != 0)
+            && (strncmp(instrDescriptor, "USB", 3) != 0))
+            it->status = probe_skipped;
+    }
+    if (findList != VI_NULL)
+        viClose(findList);
+    return i;
 }
 
-int write_exact(byte *buf, int len)
+ViStatus list_instruments()
 {
-  int i, wrote = 0;
+    ViStatus status = viOpenDefaultRM(&probe_rm);
+    int r;
+
+    if (status < VI_SUCCESS)
+    {
+        printf("Could not open a session to the VISA Resource Manager!\n");
+        return status;
+    }
+    r = probe_scan(visa_find, visa_probe);
+    viClose(probe_rm);
+    return r;
+}
 
-  do 
-  {
-    if ((i = write(1, buf + wrote, len - wrote)) <= 0)
-      return i;
-    wrote += i;
-  } while (wrote < len);
+void visa_close(gpib_dev *dev);
 
-  return len;
+/*
+ *  After each GPIB call, the application checks whether the call
+ *  succeeded. If an NI-488.2 call fails, the GPIB driver sets the
+ *  corresponding bit in the global status variable. If the call
+ *  failed, this procedure prints an error message, takes the board
+ *  offline and exits.
+ */
+void GPIBCleanup(gpib_dev *dev, const char* ErrorMsg)
+{
+    dbg_print("GPIBCleanup: "); dbg_print(ErrorMsg); dbg_print("\n");
+    visa_close(dev);
 }
 
-int read_cmd(byte *buf)
+// VISA backend, dev->addr is a VISA resource string. All sessions share
+// one resource manager.
+
+ViStatus _VI_FUNCH visa_on_io(ViSession vi, ViEventType type, ViEvent ev, ViAddr user);
+
+// Per session state: the service request thread, and the job of the
+// asynchronous transfer in flight.
+struct visa_state
+{
+    volatile bool srq_on;
+    event_t srq_done;
+    ViJobId job;
+    ViUInt32 tmo;                   // timeout as opened (ms)
+};
+
+int visa_open(gpib_dev *dev)
 {
-  int len;
+    visa_state *st;
+    ViSession vi = VI_NULL;
+    ViStatus status;
 
-  if (read_exact(buf, 2) != 2)
-    return -1;
-  len = (buf[0] << 8) | buf[1];
-  return read_exact(buf, len);
+    // the first open comes from the main thread before any other starts;
+    // sessions are opened again on threads of their own by session_reopen
+    if (!rm_inited)
+    {
+        lock_init(&rm_lock);
+        rm_inited = true;
+    }
+    dev->ud = VI_NULL;
+    lock_enter(&rm_lock);
+    if ((rm == VI_NULL) && ((status = viOpenDefaultRM(&rm)) < VI_SUCCESS))
+    {
+        rm = VI_NULL;
+        lock_leave(&rm_lock);
+        dev->code = status;
+        tracef(TRACE_ERROR, "Could not open a session to the VISA Resource Manager (%ld)", (long)status);
+        return gpib_fatal;
+    }
+    status = viOpen(rm, dev->addr, VI_NULL, VI_NULL, &vi);
+    if (status >= VI_SUCCESS)
+        rm_users++;
+    else if (rm_users == 0)
+    {
+        viClose(rm);
+        rm = VI_NULL;
+    }
+    lock_leave(&rm_lock);
+    if (status < VI_SUCCESS)
+    {
+        dev->code = status;
+        return gpib_error;
+    }
+    dev->ud = vi;
+
+    // a dead LAN link shows up as VI_ERROR_CONN_LOST, even while idle
+    if (strncmp(dev->addr, "TCPIP", 5) == 0)
+        viSetAttribute(vi, VI_ATTR_TCPIP_KEEPALIVE, VI_TRUE);
+
+    st = (visa_state *)calloc(1, sizeof(visa_state));
+    if (st == NULL)
+        return gpib_error;
+    event_init(&st->srq_done);
+    dev->priv = st;
+    viGetAttribute(dev->ud, VI_ATTR_TMO_VALUE, &st->tmo);
+
+    if ((viInstallHandler(dev->ud, VI_EVENT_IO_COMPLETION, visa_on_io, (ViAddr)dev) < VI_SUCCESS)
+        || (viEnableEvent(dev->ud, VI_EVENT_IO_COMPLETION, VI_HNDLR, VI_NULL) < VI_SUCCESS))
+        return gpib_error;
+    return gpib_ok;
 }
 
-int write_cmd(byte *buf, int len)
+// class of VISA status, see gpib_status
+int visa_status(ViStatus status)
 {
-  byte li;
+    if (status >= VI_SUCCESS)
+        return gpib_ok;
+    switch (status)
+    {
+    case VI_ERROR_TMO:
+    case VI_ERROR_ABORT:
+        return gpib_timeout;
+    case VI_ERROR_NLISTENERS:
+        return gpib_no_listener;
+    case VI_ERROR_CONN_LOST:    // the link or the session is gone
+    case VI_ERROR_INV_OBJECT:
+    case VI_ERROR_RSRC_NFOUND:
+    case VI_ERROR_SYSTEM_ERROR:
+        return gpib_fatal;
+    default:
+        return gpib_error;
+    }
+}
 
-  li = (len >> 8) & 0xff;
-  write_exact(&li, 1);
-  
-  li = len & 0xff;
-  write_exact(&li, 1);
+// visa_status, keeping a failure in dev->code
+int visa_result(gpib_dev *dev, ViStatus status)
+{
+    if (status < VI_SUCCESS)
+        dev->code = status;
+    return visa_status(status);
+}
 
-  return write_exact(buf, len);
+int visa_clear(gpib_dev *dev)
+{
+    return visa_result(dev, viClear(dev->ud));
 }
 
-struct gpib_port_comm
+int visa_write(gpib_dev *dev, const byte *buf, long len, long *cnt)
 {
-    int len;
-    char t;
-    byte *b;
-};
+    ViUInt32 n = 0;
+    ViStatus status = viWrite(dev->ud, (ViBuf)buf, len, &n);
+    *cnt = n;
+    return visa_result(dev, status);
+}
 
-bool read_comm_cmd(gpib_port_comm &r)
+int visa_read(gpib_dev *dev, byte *buf, long len, long *cnt)
 {
-    static byte cmd_buf[MAX_COMM_PACK_SIZE];
-    r.len = -1;
-    int len = read_cmd(cmd_buf);
-    if (len < 0)
-        return false;
-    
-    r.t = cmd_buf[0];
-    r.len = len - 1;
-    r.b = cmd_buf + 1;
-    r.b[r.len] = 0;
-    return true;
+    ViUInt32 n = 0;
+    ViStatus status = viRead(dev->ud, (ViBuf)buf, len, &n);
+    *cnt = n;
+    dev->end = status != VI_SUCCESS_MAX_CNT;
+    return visa_result(dev, status);
 }
 
-bool send_comm_response(const int t, const byte *s, const int len)
+// Asynchronous transfers end in visa_on_io, on a VISA thread. The
+// completion event is posted even when the call finished synchronously
+// (VI_SUCCESS_SYNC).
+
+ViStatus _VI_FUNCH visa_on_io(ViSession vi, ViEventType type, ViEvent ev, ViAddr user)
 {
-    static byte out_buf[MAX_COMM_PACK_SIZE];
-    if (1 + len > MAX_COMM_PACK_SIZE)
-        return false;
+    gpib_dev *dev = (gpib_dev *)user;
+    ViStatus status = VI_ERROR_SYSTEM_ERROR;
+    ViUInt32 n = 0;
+
+    viGetAttribute(ev, VI_ATTR_STATUS, &status);
+    viGetAttribute(ev, VI_ATTR_RET_COUNT_32, &n);
+    dev->end = status != VI_SUCCESS_MAX_CNT;
+    dev->on_complete(dev, visa_result(dev, status), n);
+    return VI_SUCCESS;
+}
 
-    out_buf[0] = t;
-    memcpy(out_buf + 1, s, len);
+int visa_write_async(gpib_dev *dev, const byte *buf, long len)
+{
+    visa_state *st = (visa_state *)dev->priv;
+    return visa_result(dev, viWriteAsync(dev->ud, (ViBuf)buf, len, &st->job));
+}
 
-    return write_cmd(out_buf, len + 1) > 0; 
+int visa_read_async(gpib_dev *dev, byte *buf, long len)
+{
+    visa_state *st = (visa_state *)dev->priv;
+    return visa_result(dev, viReadAsync(dev->ud, (ViBuf)buf, len, &st->job));
 }
 
-void send_msg_response(const int t, const char *s)
+// the transfer ends with VI_ERROR_ABORT, reported to visa_on_io
+int visa_stop(gpib_dev *dev)
 {
-    if (!shutup)
-        send_comm_response(t, (const byte *)s, strlen(s));
+    visa_state *st = (visa_state *)dev->priv;
+    return visa_status(viTerminate(dev->ud, VI_NULL, st->job));
 }
 
-void help()
+int visa_set_timeout(gpib_dev *dev, long ms)
 {
-    printf("GPIB client command options: \n");
-    printf("    -port               as an Erlang port\n");
-    printf("    -board  <N>         (LAN) board index \n");
-    printf("    -ip     'IP addr'   (LAN) IP address string\n");
-    printf("    -name   <Name>      (LAN) device name\n");
-    printf("    -gpib   <N>         (GPIB) board handle \n");
-    printf("    -pad    <N>         (GPIB) primary address\n");
-    printf("    -sad    <N>         (GPIB) secondery address\n");
-    printf("    -ls                 list all instruments on a board and quit\n");
-    printf("    -shutup             suppress all error/debug prints\n");    
-    printf("    -help/-?            show this information\n");
-    printf("Note: Press Enter (empty input) to read device response\n");
+    visa_state *st = (visa_state *)dev->priv;
+    ViUInt32 tmo = ms > 0 ? (ViUInt32)ms : st->tmo;
+    return visa_status(viSetAttribute(dev->ud, VI_ATTR_TMO_VALUE, (ViAttrState)tmo));
 }
 
-ViStatus list_instruments()
+// Service requests are waited for by a thread of their own, which reads
+// the status byte and, if a message is available, the message.
+
+#define STB_MAV 0x10                // message available
+
+void visa_srq_wait(void *arg)
 {
-    char instrDescriptor[VI_FIND_BUFLEN];
-    ViUInt32 numInstrs;
-    ViFindList findList;
-    ViSession defaultRM, instr;
+    gpib_dev *dev = (gpib_dev *)arg;
+    visa_state *st = (visa_state *)dev->priv;
+    ViEventType type;
+    ViEvent ev;
     ViStatus status;
+    ViUInt16 stb;
+    ViUInt32 n;
+    byte *buf = (byte *)malloc(read_size);
+
+    while (st->srq_on && (buf != NULL))
+    {
+        status = viWaitOnEvent(dev->ud, VI_EVENT_SERVICE_REQ, 200, &type, &ev);
+        if (status == VI_ERROR_TMO)
+            continue;
+        if (status < VI_SUCCESS)
+            break;
+        viClose(ev);
+
+        if (viReadSTB(dev->ud, &stb) < VI_SUCCESS)
+            break;
+        n = 0;
+        if ((stb & STB_MAV)
+            && (viRead(dev->ud, (ViBuf)buf, read_size, &n) < VI_SUCCESS))
+            n = 0;
+        dev->on_receive(dev, stb, buf, n);
+    }
 
-    /* First we will need to open the default resource manager. */
-   status = viOpenDefaultRM (&defaultRM);
-   if (status < VI_SUCCESS)
-   {
-      printf("Could not open a session to the VISA Resource Manager!\n");
-      exit (EXIT_FAILURE);
-   }  
-
-    /*
-     * Find all the VISA resources in our system and store the number of resources
-     * in the system in numInstrs.  Notice the different query descriptions a
-     * that are available.
-
-        Interface         Expression
-    --------------------------------------
-        GPIB              "GPIB[0-9]*::?*INSTR"
-        VXI               "VXI?*INSTR"
-        GPIB-VXI          "GPIB-VXI?*INSTR"
-        Any VXI           "?*VXI[0-9]*::?*INSTR"
-        Serial            "ASRL[0-9]*::?*INSTR"
-        PXI               "PXI?*INSTR"
-        All instruments   "?*INSTR"
-        All resources     "?*"
-    */
-   status = viFindRsrc (defaultRM, "?*INSTR", &findList, &numInstrs, instrDescriptor);
-   if (status < VI_SUCCESS)
-   {
-      printf ("An error occurred while finding resources.\nHit enter to continue.");
-      fflush(stdin);
-      getchar();
-      viClose (defaultRM);
-      return status;
-   }
-
-   printf("%d instruments, serial ports, and other resources found:\n\n",numInstrs);
-   printf("%s \n",instrDescriptor);
-
-   /* Now we will open a session to the instrument we just found. */
-   status = viOpen (defaultRM, instrDescriptor, VI_NULL, VI_NULL, &instr);
-   if (status < VI_SUCCESS)
-   {
-      printf ("An error occurred opening a session to %s\n",instrDescriptor);
-   }
-   else
-   {
-     /* Now close the session we just opened.                            */
-     /* In actuality, we would probably use an attribute to determine    */
-     /* if this is the instrument we are looking for.                    */
-     viClose (instr);
-   }
-        
-   while (--numInstrs)
-   {
-      /* stay in this loop until we find all instruments */
-      status = viFindNext (findList, instrDescriptor);  /* find next desriptor */
-      if (status < VI_SUCCESS) 
-      {   /* did we find the next resource? */
-         printf ("An error occurred finding the next resource.\n");
-         continue;
-      } 
-      printf("List %s: \n",instrDescriptor);
-
-      if ((strstr(instrDescriptor, "GPIB") != instrDescriptor) && (strstr(instrDescriptor, "TCPIP") == instrDescriptor))
-          continue;
-    
-      /* Now we will open a session to the instrument we just found */
-      status = viOpen(defaultRM, instrDescriptor, VI_NULL, VI_NULL, &instr);
-      if (status < VI_SUCCESS)
-      {
-          printf ("An error occurred opening a session to %s\n",instrDescriptor);
-      }
-      else
-      {
-          char s[] = "*IDN?\n";
-          char r[1024];
-          ViUInt32 retCount = 0;
-          viWrite(instr, (ViBuf)s, strlen(s), &retCount);
-          retCount = 0;
-          if (viRead(instr, (ViBuf)r, sizeof(r) - 1, &retCount) >= VI_SUCCESS)
-          {
-              r[retCount] = '\0';
-              printf("%s\n", r);
-          }
-          viClose(instr);
-      }
-   }    /* end while */
-
-   status = viClose(findList);
-   status = viClose (defaultRM);
-   printf ("\nHit enter to continue.");
-   getchar();
-
-   return 0;
+    if (st->srq_on)
+        dev->on_receive(dev, 0, NULL, -1);
+    free(buf);
+    event_set(&st->srq_done);
 }
 
-void gpib_shutdown(gpib_dev *dev)
+int visa_enable_srq(gpib_dev *dev, bool on)
 {
-    viClose(dev->dev);
-    viClose(dev->rm);
+    visa_state *st = (visa_state *)dev->priv;
+
+    if (st->srq_on == on)
+        return gpib_ok;
+
+    if (on)
+    {
+        if (viEnableEvent(dev->ud, VI_EVENT_SERVICE_REQ, VI_QUEUE, VI_NULL) < VI_SUCCESS)
+            return gpib_error;
+        st->srq_on = true;
+        if (!thread_start(visa_srq_wait, dev))
+        {
+            st->srq_on = false;
+            viDisableEvent(dev->ud, VI_EVENT_SERVICE_REQ, VI_QUEUE);
+            return gpib_error;
+        }
+    }
+    else
+    {
+        st->srq_on = false;
+        event_wait(&st->srq_done, -1);
+        viDisableEvent(dev->ud, VI_EVENT_SERVICE_REQ, VI_QUEUE);
+    }
+    return gpib_ok;
 }
 
-/*
- *  After each GPIB call, the application checks whether the call
- *  succeeded. If an NI-488.2 call fails, the GPIB driver sets the
- *  corresponding bit in the global status variable. If the call
- *  failed, this procedure prints an error message, takes the board
- *  offline and exits.
- */
-void GPIBCleanup(gpib_dev *dev, const char* ErrorMsg)
+void visa_close(gpib_dev *dev)
 {
-    dbg_print("GPIBCleanup: "); dbg_print(ErrorMsg);
-    viClose(dev->dev);
-    viClose(dev->rm);
+    if (dev->priv != NULL)
+    {
+        visa_enable_srq(dev, false);
+        viDisableEvent(dev->ud, VI_EVENT_IO_COMPLETION, VI_HNDLR);
+        viUninstallHandler(dev->ud, VI_EVENT_IO_COMPLETION, visa_on_io, (ViAddr)dev);
+        free(dev->priv);
+        dev->priv = NULL;
+    }
+    // not opened, or closed already
+    if ((dev->ud == VI_NULL) || (dev->ud == -1))
+        return;
+    viClose(dev->ud);
+    dev->ud = VI_NULL;
+    lock_enter(&rm_lock);
+    if (--rm_users == 0)
+    {
+        viClose(rm);
+        rm = VI_NULL;
+    }
+    lock_leave(&rm_lock);
+}
+
+void visa_cleanup(gpib_dev *dev, const char *msg)
+{
+    GPIBCleanup(dev, msg);
 }
 
+const gpib_backend visa_backend =
+{
+    "visa",
+    visa_open,
+    visa_clear,
+    visa_write,
+    visa_read,
+    visa_close,
+    visa_cleanup,
+    visa_enable_srq,
+    visa_write_async,
+    visa_read_async,
+    visa_set_timeout,
+    visa_stop
+};
+
 static gpib_dev dev;
 
 BOOL ctrl_handler(DWORD fdwCtrlType) 
@@ -283,6 +441,7 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
     switch (fdwCtrlType) 
     {
         case CTRL_C_EVENT: 
+            close_sessions();
             gpib_shutdown(&dev);
             exit(0);
             return TRUE;
@@ -294,6 +453,7 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
         case CTRL_CLOSE_EVENT: 
         case CTRL_LOGOFF_EVENT: 
         case CTRL_SHUTDOWN_EVENT:
+            close_sessions();
             gpib_shutdown(&dev);
             exit(0);
             return FALSE; 
@@ -303,18 +463,9 @@ BOOL ctrl_handler(DWORD fdwCtrlType)
     } 
 }
 
-int as_port(gpib_dev *dev);
-int interactive(gpib_dev *dev);
-int __stdcall cb_on_rqs(int LocalUd, int LocalIbsta, int LocalIberr, 
-      long LocalIbcntl, void *RefData);
-void stdout_on_receive(const char *s, const int len);
-void port_on_receive(const char *s, const int len);
-
 int main(const int argc, const char *args[])
 {   
-    dev.rm = 0;
-    dev.dev = 0;
-    dev.addr[0] = '\0';
+    gpib_dev_init(&dev, &visa_backend);
 
 #define load_i_param(var, param) \
     if (strcmp(args[i], "-"#param) == 0)   \
@@ -340,9 +491,33 @@ int main(const int argc, const char *args[])
         else load_s_param(name, name)
         else load_b_param(shutup)
         else load_b_param(port)
-        else if (strcmp(args[i], "-ls") == 0) 
+        else load_b_param(srq)
+        else load_b_param(read_ahead)
+        else load_i_param(coalesce_us, coalesce)
+        else load_i_param(tmo_adapt, tmo_adapt)
+        else load_i_param(tmo_min, tmo_min)
+        else load_i_param(tmo_max, tmo_max)
+        else load_i_param(reconnect_s, reconnect)
+        else load_i_param(packet_bytes, packet)
+        else load_i_param(max_frame, max_frame)
+        else load_i_param(read_size, rdsize)
+        else load_i_param(out_buf_size, outbuf)
+        else load_i_param(flush_us, flush_us)
+        else load_i_param(proto, proto)
+        else load_i_param(trace_level, trace)
+        else load_b_param(ls)
+        else load_s_param(inv_path, cache)
+        else load_i_param(probe_ms, probe_ms)
+        else load_i_param(probe_jobs, ls_jobs)
+        else if (strcmp(args[i], "-json") == 0)
         {
-            return list_instruments();
+            probe_json = true;
+            i++;
+        }
+        else if (strcmp(args[i], "-refresh") == 0)
+        {
+            probe_refresh = true;
+            i++;
         }
         else if ((strcmp(args[i], "-help") == 0) || (strcmp(args[i], "-?") == 0))
         {
@@ -353,6 +528,16 @@ int main(const int argc, const char *args[])
             i++;
     }
 
+    if (ls)
+        return list_instruments();
+
+    if ((pad < 0) && (strlen(ip) < 1) && port && (proto >= 3))
+    {
+        // sessions are opened through the port
+        set_binary_stdio();
+        return as_port(&visa_backend, NULL);
+    }
+
     if ((pad < 0) && (strlen(ip) < 1))
     {
         dbg_print("neigher LAN or GPIB address is specified!\n");
@@ -383,21 +568,15 @@ int main(const int argc, const char *args[])
     if (!SetConsoleCtrlHandler((PHANDLER_ROUTINE)ctrl_handler, TRUE))
         dbg_print("WARNING: SetConsoleCtrlHandler failed.\n");
 
-    if (viOpenDefaultRM(&dev.rm) < VI_SUCCESS)
-    {
-        dbg_print("Could not open a session to the VISA Resource Manager!\n");
-        exit(EXIT_FAILURE);
-    }  
-
-    if (viOpen(dev.rm, dev.addr, VI_NULL, VI_NULL, &dev.dev) < VI_SUCCESS)
+    if (dev.be->open(&dev) != gpib_ok)
     {
-       GPIBCleanup(&dev, "Unable to open device\n");
+       dev.be->cleanup(&dev, "Unable to open device");
        return 1;
     }    
 
-    if (viClear(dev.dev) < VI_SUCCESS)
+    if (dev.be->clear(&dev) != gpib_ok)
     {
-       GPIBCleanup(&dev, "Unable to clear device\n");
+       dev.be->cleanup(&dev, "Unable to clear device");
        return 1;
     }
 
@@ -405,11 +584,16 @@ int main(const int argc, const char *args[])
     if (port)
         dev.on_receive = port_on_receive;
 
+    if (srq && (port_enable_srq(&dev, true) != gpib_ok))
+    {
+       dev.be->cleanup(&dev, "Unable to set up service requests");
+       return 1;
+    }
+
     if (port)
     {
-        setmode(0, O_BINARY);
-        setmode(1, O_BINARY);
-        return as_port(&dev);
+        set_binary_stdio();
+        return as_port(&visa_backend, &dev);
     }
     else
     {
@@ -419,121 +603,3 @@ int main(const int argc, const char *args[])
     }
 }
 
-int port_read(gpib_dev *dev)
-{
-    char s[3240 + 1];
-    ViUInt32 cnt = 0;
-    ViStatus status = viRead(dev->dev, (ViBuf)s, sizeof(s) - 1, &cnt);
-    if (status < VI_SUCCESS)
-    {
-        if (status != VI_ERROR_TMO)
-        {
-            GPIBCleanup(dev, "Unable to read data from device\n");
-            return 1;
-        }
-        else
-            return 0;
-    }
-
-    send_msg_response(command_dbg_msg, "ibrd");
-
-    send_msg_response(command_dbg_msg, "send_ ing");
-    send_comm_response(command_read_from_gpib, (byte *)s, cnt);
-    return 0;
-}
-
-int as_port(gpib_dev *dev)
-{
-    ViUInt32 cnt = 0;
-    char s[3240 + 1]; 
-    send_msg_response(command_dbg_msg, "as_port");
-    while (true)
-    {
-        gpib_port_comm c;
-        send_msg_response(command_dbg_msg, "wait for command");
-        read_comm_cmd(c);
-        send_msg_response(command_dbg_msg, "read_comm_cmd");
-        switch (c.t)
-        {
-        case command_write_to_gpib:
-            send_msg_response(command_dbg_msg, "command_write_to_gpib");
-            if (c.len < 1) 
-                continue;
-
-            if (viWrite(dev->dev, c.b, c.len, &cnt) < VI_SUCCESS)
-            {
-               GPIBCleanup(dev, "Unable to write to device\n");
-               return 1;
-            }
-
-            break;
-        case command_read_from_gpib:
-            send_msg_response(command_dbg_msg, "command_read_from_gpib");
-
-            if (port_read(dev) != 0)
-                return 1;
-            break;
-        default:
-            gpib_shutdown(dev);
-            return 0;
-        }
-
-        
-    }
-}
-
-int interactive(gpib_dev *dev)
-{
-    while (true)
-    {
-        ViUInt32 cnt = 0;
-        char s[10240 + 1];
-        ViStatus status;
-
-        s[0] = '\0';
-        gets(s);
-        if (strlen(s) >= sizeof(s) - 1)
-        {
-            gpib_shutdown(dev);
-            break;
-        }
-
-        if (strlen(s) > 0)
-        {
-            status = viWrite(dev->dev, (ViBuf)s, strlen(s), &cnt);
-            if (status < VI_SUCCESS)
-            {
-               GPIBCleanup(dev, "Unable to write to device\n");
-               return 1;
-            }
-        }
-        else    // strlen(s) = 0, read response
-        {
-            status = viRead(dev->dev, (ViBuf)s, sizeof(s) - 1, &cnt);
-            if (status < VI_SUCCESS)
-            {
-                if (status != VI_ERROR_TMO)
-                {
-                    GPIBCleanup(dev, "Unable to read data from device\n");
-                    return 1;
-                }
-                else
-                    continue;
-            }
-            s[cnt] = '\n'; s[cnt + 1] = '\0';
-            printf(s);
-        }
-    }
-}
-
-void stdout_on_receive(const char *s, const int len)
-{
-    printf(s);
-}
-
-void port_on_receive(const char *s, const int len)
-{
-    send_comm_response(command_read_from_gpib, (const byte *)s, len);
-}
-
-
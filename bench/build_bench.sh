@@ -0,0 +1,6 @@
+#!/bin/sh
+# benchmarks, build anywhere with g++
+cd "$(dirname "$0")"
+rm -f xform_bench port_bench
+g++ -O2 -o xform_bench xform_bench.c ../xform.c
+g++ -O2 -o port_bench port_bench.c
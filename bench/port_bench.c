@@ -0,0 +1,299 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../platform.h"
+
+// Drives gpib_sim as an Erlang port would, {packet, N} frames with
+// request ids (-proto 2) on its stdin/stdout, and reports throughput and
+// latency percentiles as JSON. Workloads:
+//     query   query storm, "MEAS?" with command 5
+//     block   IEEE 488.2 block reads of -size bytes, "CURV?" with command 13
+//     mixed   write "MEAS?" (command 0), then read it (command 1)
+// Up to -depth requests are in flight; latency is from sending a request
+// to its last frame, for mixed from the write to the read response.
+//
+//     port_bench [-sim <path>] [-workload query|block|mixed] [-n N]
+//                [-depth N] [-size N] [-packet 2|4] [-warmup N]
+//                [-- gpib_sim options]
+//
+// POSIX only, it forks the simulator.
+
+static int to_sim = -1, from_sim = -1;
+static int packet = 2;
+
+static bool read_all(byte *buf, long len)
+{
+    long got = 0, r;
+
+    while (got < len)
+    {
+        r = read(from_sim, buf + got, len - got);
+        if (r <= 0)
+            return false;
+        got += r;
+    }
+    return true;
+}
+
+static bool write_all(const byte *buf, long len)
+{
+    long done = 0, r;
+
+    while (done < len)
+    {
+        r = write(to_sim, buf + done, len - done);
+        if (r <= 0)
+            return false;
+        done += r;
+    }
+    return true;
+}
+
+static void put_u32(byte *b, unsigned long v)
+{
+    b[0] = (v >> 24) & 0xff;
+    b[1] = (v >> 16) & 0xff;
+    b[2] = (v >> 8) & 0xff;
+    b[3] = v & 0xff;
+}
+
+static unsigned long get_u32(const byte *b)
+{
+    return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16)
+         | ((unsigned long)b[2] << 8) | b[3];
+}
+
+// <len><command:1><id:4><payload>
+static bool send_req(int t, unsigned long id, const char *s)
+{
+    byte f[64];
+    long n = strlen(s), h = packet;
+    long len = 5 + n;
+
+    if (packet == 2)
+    {
+        f[0] = (len >> 8) & 0xff;
+        f[1] = len & 0xff;
+    }
+    else
+        put_u32(f, len);
+    f[h] = t;
+    put_u32(f + h + 1, id);
+    memcpy(f + h + 5, s, n);
+    return write_all(f, h + len);
+}
+
+// reads a frame into *buf, returns its payload length or -1
+static long recv_frame(byte **buf, long *size)
+{
+    byte h[4];
+    long len;
+
+    if (!read_all(h, packet))
+        return -1;
+    len = packet == 2 ? (h[0] << 8) | h[1] : (long)get_u32(h);
+    if (len > *size)
+    {
+        byte *p = (byte *)realloc(*buf, len);
+        if (p == NULL)
+            return -1;
+        *buf = p;
+        *size = len;
+    }
+    return read_all(*buf, len) ? len : -1;
+}
+
+static pid_t spawn(const char **argv)
+{
+    int in[2], out[2];
+    pid_t pid;
+
+    if ((pipe(in) != 0) || (pipe(out) != 0))
+        return -1;
+    pid = fork();
+    if (pid == 0)
+    {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[1]);
+        close(out[0]);
+        execv(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    to_sim = in[1];
+    from_sim = out[0];
+    return pid;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// p in per mille of the sorted v
+static unsigned long long pct(const u64 *v, long n, int p)
+{
+    long i;
+
+    if (n == 0)
+        return 0;
+    i = (long)(((u64)n * p + 999) / 1000) - 1;
+    return v[i < 0 ? 0 : i];
+}
+
+int main(const int argc, const char *args[])
+{
+    const char *sim = "./gpib_sim", *workload = "query";
+    const char *argv[64];
+    char size_s[24], packet_s[4];
+    long n = 10000, depth = 1, size = 64, warmup = 100, total;
+    long sent = 0, done = 0, errors = 0, frames = 0, len, buf_size = 0;
+    u64 *start, *lat, bytes = 0, t0 = 0, t;
+    byte *buf = NULL;
+    int i = 1, k = 0, t_req;
+    const char *msg;
+    pid_t pid;
+
+    while ((i < argc) && (strcmp(args[i], "--") != 0))
+    {
+        if ((strcmp(args[i], "-sim") == 0) && (i + 1 < argc))
+            sim = args[++i];
+        else if ((strcmp(args[i], "-workload") == 0) && (i + 1 < argc))
+            workload = args[++i];
+        else if ((strcmp(args[i], "-n") == 0) && (i + 1 < argc))
+            n = atol(args[++i]);
+        else if ((strcmp(args[i], "-depth") == 0) && (i + 1 < argc))
+            depth = atol(args[++i]);
+        else if ((strcmp(args[i], "-size") == 0) && (i + 1 < argc))
+            size = atol(args[++i]);
+        else if ((strcmp(args[i], "-packet") == 0) && (i + 1 < argc))
+            packet = atoi(args[++i]);
+        else if ((strcmp(args[i], "-warmup") == 0) && (i + 1 < argc))
+            warmup = atol(args[++i]);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", args[i]);
+            return 1;
+        }
+        i++;
+    }
+
+    if (strcmp(workload, "query") == 0)
+    {
+        t_req = 5;
+        msg = "MEAS?";
+    }
+    else if (strcmp(workload, "block") == 0)
+    {
+        t_req = 13;
+        msg = "CURV?";
+    }
+    else if (strcmp(workload, "mixed") == 0)
+    {
+        t_req = 1;
+        msg = "MEAS?";
+    }
+    else
+    {
+        fprintf(stderr, "unknown workload %s\n", workload);
+        return 1;
+    }
+    if ((n < 1) || (depth < 1) || (warmup < 0) || ((packet != 2) && (packet != 4)))
+    {
+        fprintf(stderr, "bad -n, -depth, -warmup or -packet\n");
+        return 1;
+    }
+
+    sprintf(size_s, "%ld", size);
+    sprintf(packet_s, "%d", packet);
+    argv[k++] = sim;
+    argv[k++] = "-port";
+    argv[k++] = "-proto";
+    argv[k++] = "2";
+    argv[k++] = "-packet";
+    argv[k++] = packet_s;
+    argv[k++] = "-resp";
+    argv[k++] = size_s;
+    for (i++; (i < argc) && (k < (int)arr_len(argv) - 1); i++)
+        argv[k++] = args[i];
+    argv[k] = NULL;
+
+    signal(SIGPIPE, SIG_IGN);
+    pid = spawn(argv);
+    if (pid < 0)
+    {
+        fprintf(stderr, "unable to start %s\n", sim);
+        return 1;
+    }
+
+    total = n + warmup;
+    start = (u64 *)calloc(total, sizeof(u64));
+    lat = (u64 *)calloc(total, sizeof(u64));
+    if ((start == NULL) || (lat == NULL))
+        return 1;
+
+    t0 = now_us();
+    while (done < total)
+    {
+        while ((sent < total) && (sent - done < depth))
+        {
+            start[sent] = now_us();
+            if ((t_req == 1) && !send_req(0, sent, msg))
+                break;
+            if (!send_req(t_req, sent, t_req == 1 ? "" : msg))
+                break;
+            sent++;
+        }
+
+        len = recv_frame(&buf, &buf_size);
+        if (len < 5)
+        {
+            fprintf(stderr, "%s stopped after %ld requests\n", sim, done);
+            break;
+        }
+        t = now_us();
+        if (done >= warmup)
+        {
+            frames++;
+            bytes += len - 5;
+        }
+        if (buf[0] == 4)                // command_read_more, more to come
+            continue;
+        if (buf[0] == 9)
+            errors++;
+        lat[done] = t - start[get_u32(buf + 1) % total];
+        done++;
+        if (done == warmup)
+            t0 = now_us();
+    }
+    t = now_us() - t0;
+
+    send_req(3, 0, "");
+    close(to_sim);
+    waitpid(pid, NULL, 0);
+
+    n = done > warmup ? done - warmup : 0;
+    qsort(lat + warmup, n, sizeof(u64), cmp_u64);
+    printf("{\"workload\": \"%s\", \"requests\": %ld, \"depth\": %ld, \"size\": %ld, "
+           "\"packet\": %d, \"errors\": %ld, \"seconds\": %.3f, "
+           "\"requests_per_s\": %.0f, \"frames_per_s\": %.0f, \"mb_per_s\": %.2f, "
+           "\"latency_us\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+           "\"p999\": %llu, \"max\": %llu}}\n",
+           workload, n, depth, size, packet, errors, t / 1e6,
+           t > 0 ? n * 1e6 / t : 0.0, t > 0 ? frames * 1e6 / t : 0.0,
+           t > 0 ? bytes / (double)t : 0.0,
+           pct(lat + warmup, n, 500), pct(lat + warmup, n, 900),
+           pct(lat + warmup, n, 990), pct(lat + warmup, n, 999),
+           pct(lat + warmup, n, 1000));
+    free(start);
+    free(lat);
+    free(buf);
+    return done == total ? 0 : 1;
+}
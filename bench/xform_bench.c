@@ -0,0 +1,114 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../xform.h"
+
+// Decodes a multi-MB ASCII list of numbers with decode_ascii and with the
+// strtod baseline, converts a waveform of the same size with
+// convert_wave and its scalar kernel, checks they agree and prints the
+// throughput.
+//
+//     xform_bench [MB] [rounds]
+
+double run(long (* f)(const byte *, long, int, bool, byte *, long *),
+           const byte *s, long len, int kind, byte *out, long *count, int rounds)
+{
+    u64 t = now_us(), best = 0;
+    long used;
+    int i;
+
+    for (i = 0; i < rounds; i++)
+    {
+        t = now_us();
+        *count = f(s, len, kind, true, out, &used);
+        t = now_us() - t;
+        if ((i == 0) || (t < best))
+            best = t;
+    }
+    return best > 0 ? (double)len / best : 0;       // MB/s
+}
+
+double run_wave(void (* f)(const byte *, long, const wave_fmt *, byte *),
+                const byte *s, long n, const wave_fmt *w, byte *out, int rounds)
+{
+    u64 t, best = 0;
+    int i;
+
+    for (i = 0; i < rounds; i++)
+    {
+        t = now_us();
+        f(s, n, w, out);
+        t = now_us() - t;
+        if ((i == 0) || (t < best))
+            best = t;
+    }
+    return best > 0 ? (double)n * wave_bytes(w->type) / best : 0;
+}
+
+int main(const int argc, const char *args[])
+{
+    long mb = argc > 1 ? atol(args[1]) : 8;
+    int rounds = argc > 2 ? atoi(args[2]) : 5;
+    long size = mb * 1024 * 1024, len = 0, n1, n2;
+    byte *s = (byte *)malloc(size + 64);
+    byte *o1, *o2;
+    double r1, r2;
+    int kind;
+
+    if (s == NULL)
+        return 1;
+    srand(1);
+    while (len < size)
+    {
+        // the formats instruments send: "+1.23456789E-03", "12.5", "-7"
+        switch (rand() % 3)
+        {
+        case 0:
+            len += sprintf((char *)s + len, "%+.8E,", (rand() - RAND_MAX / 2) * 1e-6);
+            break;
+        case 1:
+            len += sprintf((char *)s + len, "%.4f,", rand() / 1000.0);
+            break;
+        default:
+            len += sprintf((char *)s + len, "%d,", rand() % 20000 - 10000);
+            break;
+        }
+    }
+    s[len - 1] = '\n';
+
+    o1 = (byte *)malloc((len / 2 + 1) * 8);
+    o2 = (byte *)malloc((len / 2 + 1) * 8);
+    if ((o1 == NULL) || (o2 == NULL))
+        return 1;
+
+    for (kind = xform_f64; kind <= xform_f32; kind++)
+    {
+        r1 = run(decode_ascii_scalar, s, len, kind, o1, &n1, rounds);
+        r2 = run(decode_ascii, s, len, kind, o2, &n2, rounds);
+        printf("%s: %ld bytes, %ld values, strtod %.1f MB/s, decode_ascii %.1f MB/s (x%.2f), %s\n",
+               kind == xform_f64 ? "f64" : "f32", len, n2, r1, r2, r1 > 0 ? r2 / r1 : 0,
+               (n1 == n2) && (memcmp(o1, o2, n1 * xform_size(kind)) == 0) ? "same" : "MISMATCH");
+    }
+
+    static const char *types[] = {"i8", "u8", "i16", "u16"};
+    wave_fmt w;
+    long i;
+
+    for (i = 0; i < len; i++)
+        s[i] = (byte)rand();
+    w.scale = 0.0025f;
+    w.offset = -1.5f;
+    for (w.type = wave_i8; w.type <= wave_u16; w.type++)
+    {
+        w.big = w.type == wave_i16;
+        n1 = len / wave_bytes(w.type);
+        r1 = run_wave(convert_wave_scalar, s, n1, &w, o1, rounds);
+        r2 = run_wave(convert_wave, s, n1, &w, o2, rounds);
+        printf("%s%s: %ld samples, scalar %.1f MB/s, %s %.1f MB/s (x%.2f), %s\n",
+               types[w.type], w.big ? " BE" : "", n1, r1, wave_kernel(), r2, r1 > 0 ? r2 / r1 : 0,
+               memcmp(o1, o2, n1 * 4) == 0 ? "same" : "MISMATCH");
+    }
+    return 0;
+}
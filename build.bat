@@ -1,5 +1,5 @@
 del gpib.exe
-g++ -fpermissive -o gpib.exe -I .\ni .\ni\gpib-32.obj GPIB.c
+g++ -fpermissive -o gpib.exe -I .\ni .\ni\gpib-32.obj GPIB.c gpib_port.c trace.c xform.c probe.c hist.c
 
 del "D:\Program Files\erl6.2\lib\uetest-0.1\priv\gpib.exe"
 copy gpib.exe "D:\Program Files\erl6.2\lib\uetest-0.1\priv\"
\ No newline at end of file
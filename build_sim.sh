@@ -0,0 +1,4 @@
+#!/bin/sh
+# simulated instrument, builds anywhere with g++
+rm -f gpib_sim
+g++ -O2 -o gpib_sim GPIB_sim.c gpib_port.c trace.c xform.c probe.c hist.c -pthread
@@ -0,0 +1,89 @@
+
+#ifndef _GPIB_DEV_H
+#define _GPIB_DEV_H
+
+#include "platform.h"
+
+// Result of a backend call.
+enum gpib_status
+{
+    gpib_ok = 0,
+    gpib_timeout,       // timed out or aborted, the session is still usable
+    gpib_error,         // bus error, a device clear recovers the session
+    gpib_no_listener,   // nobody at the address, the session is still usable
+    gpib_fatal          // the session is lost and has to be opened again
+};
+
+struct gpib_dev;
+
+// Data the device pushed on a service request: stb is the status byte,
+// len < 0 reports that the service request handling failed. May be called
+// from a driver thread.
+typedef void (* f_on_receive)(gpib_dev *dev, const int stb, const byte *s, const long len);
+
+// End of an asynchronous transfer: status is a gpib_status, cnt the bytes
+// moved. May be called from a driver thread.
+typedef void (* f_on_complete)(gpib_dev *dev, const int status, const long cnt);
+
+// Device calls of one transport (NI-488.2, VISA, simulated, ...).
+// All of them work on an opened gpib_dev and return a gpib_status.
+struct gpib_backend
+{
+    const char *name;
+
+    // open dev->addr
+    int  (* open)(gpib_dev *dev);
+    int  (* clear)(gpib_dev *dev);
+    int  (* write)(gpib_dev *dev, const byte *buf, long len, long *cnt);
+    int  (* read)(gpib_dev *dev, byte *buf, long len, long *cnt);   // sets dev->end
+    void (* close)(gpib_dev *dev);
+
+    // report the last error and take the device offline
+    void (* cleanup)(gpib_dev *dev, const char *msg);
+
+    // deliver service requests to dev->on_receive, NULL if not supported
+    int  (* enable_srq)(gpib_dev *dev, bool on);
+
+    // start a transfer and report its end to dev->on_complete, NULL if not
+    // supported; one transfer per device at a time, buf stays valid until
+    // it ends
+    int  (* write_async)(gpib_dev *dev, const byte *buf, long len);
+    int  (* read_async)(gpib_dev *dev, byte *buf, long len);
+
+    // timeout of the transfers that follow, ms <= 0 restores the one the
+    // device was opened with; NULL if not supported
+    int  (* set_timeout)(gpib_dev *dev, long ms);
+
+    // abort the transfer in flight, whose end is still reported, as
+    // gpib_timeout; NULL if not supported
+    int  (* stop)(gpib_dev *dev);
+};
+
+struct gpib_dev
+{
+    const gpib_backend *be;
+    char addr[500];
+    long ud;                    // NI unit descriptor / VISA session
+    void *priv;                 // backend private data
+    int handle;                 // port session
+    volatile bool end;          // the last read ended with END (EOI)
+    long code;                  // backend error of the last failure,
+                                // iberr or ViStatus
+    f_on_receive on_receive;
+    f_on_complete on_complete;
+};
+
+inline void gpib_dev_init(gpib_dev *dev, const gpib_backend *be)
+{
+    dev->be = be;
+    dev->addr[0] = '\0';
+    dev->ud = -1;
+    dev->priv = 0;
+    dev->handle = 0;
+    dev->end = false;
+    dev->code = 0;
+    dev->on_receive = 0;
+    dev->on_complete = 0;
+}
+
+#endif
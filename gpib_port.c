@@ -0,0 +1,2767 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "gpib_port.h"
+#include "trace.h"
+#include "xform.h"
+#include "probe.h"
+#include "hist.h"
+
+bool shutup = false;
+bool port   = false;
+bool srq    = false;
+int  packet_bytes = 2;
+long max_frame    = 0;
+long read_size    = MAX_COMM_PACK_SIZE - 2;
+long out_buf_size = 65536;
+long flush_us     = 1000;
+int  proto        = 1;
+bool read_ahead   = false;
+long coalesce_us  = 0;
+long tmo_adapt    = 0;
+long tmo_min      = 20;
+long tmo_max      = 10000;
+long reconnect_s  = 0;
+
+static unsigned long cur_id = 0;    // id of the request being served
+static int cur_session = 0;         // and its session
+
+// Sessions opened through the port, session 0 is the device given on the
+// command line (owned by main).
+static gpib_dev *sessions[MAX_SESSIONS];
+static const gpib_backend *port_backend = NULL;
+
+// prints to stderr and keeps a copy in the trace ring
+void dbg_print(const char *fmt, ...)
+{
+    char s[TRACE_MSG_LEN];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(s, sizeof(s), fmt, args);
+    va_end(args);
+    s[sizeof(s) - 1] = '\0';
+    trace(TRACE_ERROR, s);
+
+    if (shutup)
+        return;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+int read_exact(byte *buf, int len)
+{
+  int i, got=0;
+
+  do
+  {
+    if ((i = read(0, buf + got, len - got)) <= 0)
+      return i;
+    got += i;
+  } while (got < len);
+
+  return len;
+}
+
+int write_exact(byte *buf, int len)
+{
+  int i, wrote = 0;
+
+  do
+  {
+    if ((i = write(1, buf + wrote, len - wrote)) <= 0)
+      return i;
+    wrote += i;
+  } while (wrote < len);
+
+  return len;
+}
+
+static hist out_hist;                   // time of the writes to stdout
+static u64 out_bytes = 0;
+
+// Writes the pieces with one syscall where the platform allows it.
+static int write_vec_now(io_vec *v, int n)
+{
+  long total = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    total += v[i].len;
+
+#ifdef _WIN32
+  // no gather write for CRT handles, so gather it here
+  static byte *tmp = NULL;
+  static long tmp_size = 0;
+  long pos = 0;
+  int last = -1, used = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    if (v[i].len > 0)
+    {
+      last = i;
+      used++;
+    }
+  }
+  if (used == 0)
+    return 0;
+  if (used == 1)
+    return write_exact((byte *)v[last].base, v[last].len);
+  if (total > tmp_size)
+  {
+    byte *p = (byte *)realloc(tmp, total);
+    if (p == NULL)
+      return -1;
+    tmp = p;
+    tmp_size = total;
+  }
+  for (i = 0; i < n; i++)
+  {
+    memcpy(tmp + pos, v[i].base, v[i].len);
+    pos += v[i].len;
+  }
+  return write_exact(tmp, total);
+#else
+  struct iovec iov[8];
+  long wrote = 0;
+  int cnt = 0;
+
+  if (n > (int)arr_len(iov))
+    return -1;
+  for (i = 0; i < n; i++)
+  {
+    if (v[i].len == 0)
+      continue;
+    iov[cnt].iov_base = (void *)v[i].base;
+    iov[cnt].iov_len  = v[i].len;
+    cnt++;
+  }
+
+  i = 0;
+  while (wrote < total)
+  {
+    ssize_t r = writev(1, iov + i, cnt - i);
+    if (r <= 0)
+      return (int)r;
+    wrote += r;
+    while ((i < cnt) && ((size_t)r >= iov[i].iov_len))
+    {
+      r -= iov[i].iov_len;
+      i++;
+    }
+    if (i < cnt)
+    {
+      iov[i].iov_base = (byte *)iov[i].iov_base + r;
+      iov[i].iov_len -= r;
+    }
+  }
+  return total;
+#endif
+}
+
+int write_vec(io_vec *v, int n)
+{
+  u64 t = now_us();
+  int r = write_vec_now(v, n);
+
+  if (r > 0)
+  {
+    hist_add(&out_hist, now_us() - t);
+    out_bytes += r;
+  }
+  return r;
+}
+
+int put_packet_len(byte *h, long len)
+{
+  int i;
+
+  for (i = packet_bytes - 1; i >= 0; i--)
+  {
+    h[i] = len & 0xff;
+    len >>= 8;
+  }
+  return packet_bytes;
+}
+
+unsigned long get_u32(const byte *b)
+{
+    return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16)
+         | ((unsigned long)b[2] << 8) | b[3];
+}
+
+void put_u32(byte *b, unsigned long v)
+{
+    b[0] = (v >> 24) & 0xff;
+    b[1] = (v >> 16) & 0xff;
+    b[2] = (v >> 8) & 0xff;
+    b[3] = v & 0xff;
+}
+
+// IEEE 754 double, big-endian
+double get_f64(const byte *b)
+{
+    u64 v = ((u64)get_u32(b) << 32) | get_u32(b + 4);
+    double d;
+    memcpy(&d, &v, sizeof(d));
+    return d;
+}
+
+long read_packet_len()
+{
+  byte h[4];
+  long len = 0;
+  int i;
+
+  if (read_exact(h, packet_bytes) != packet_bytes)
+    return -1;
+  for (i = 0; i < packet_bytes; i++)
+    len = (len << 8) | h[i];
+  return len;
+}
+
+// reads and drops len bytes of input
+static bool skip_input(long len)
+{
+  byte b[512];
+  int n;
+
+  while (len > 0)
+  {
+    n = len < (long)sizeof(b) ? (int)len : (int)sizeof(b);
+    if (read_exact(b, n) != n)
+      return false;
+    len -= n;
+  }
+  return true;
+}
+
+// Reads one packet into buf, which is grown as needed. Returns -1 at the
+// end of input, -2 if the packet was too big or out of memory and dropped.
+long read_cmd(byte **buf, long *size)
+{
+  long len = read_packet_len();
+
+  if (len < 0)
+    return -1;
+  if (len + 1 > *size)
+  {
+    byte *p = len <= MAX_COMM_PACK_SIZE_4 ? (byte *)realloc(*buf, len + 1) : NULL;
+    if (p == NULL)
+      return skip_input(len) ? -2 : -1;
+    *buf = p;
+    *size = len + 1;
+  }
+  return read_exact(*buf, len) == len ? len : -1;
+}
+
+// Output frames are collected in out_buf and written out together when
+// it is full, when the oldest one has waited flush_us, or by out_flush()
+// before anything that may block.
+
+static byte *out_buf = NULL;
+static long out_len = 0;
+static u64  out_first = 0;
+
+int out_flush()
+{
+  io_vec v;
+  int r;
+
+  if (out_len == 0)
+    return 0;
+  v.base = out_buf;
+  v.len  = out_len;
+  out_len = 0;
+  r = write_vec(&v, 1);
+  return r;
+}
+
+int write_frame(const byte *h, int hl, const byte *buf, long len)
+{
+  if ((out_buf_size > 0) && (out_len + hl + len <= out_buf_size))
+  {
+    if (out_buf == NULL)
+    {
+      out_buf = (byte *)malloc(out_buf_size);
+      if (out_buf == NULL)
+      {
+        out_buf_size = 0;
+        return write_frame(h, hl, buf, len);
+      }
+    }
+
+    if (out_len == 0)
+      out_first = now_us();
+    memcpy(out_buf + out_len, h, hl);
+    memcpy(out_buf + out_len + hl, buf, len);
+    out_len += hl + len;
+
+    if (now_us() - out_first >= (u64)flush_us)
+      return out_flush() < 0 ? -1 : hl + len;
+    return hl + len;
+  }
+  else
+  {
+    // pending frames, header and payload with a single write
+    io_vec v[3];
+    v[0].base = out_buf; v[0].len = out_len;
+    v[1].base = h;       v[1].len = hl;
+    v[2].base = buf;     v[2].len = len;
+    out_len = 0;
+    return write_vec(v, 3);
+  }
+}
+
+int write_cmd(byte *buf, long len)
+{
+  byte h[4];
+  return write_frame(h, put_packet_len(h, len), buf, len);
+}
+
+long max_frame_size()
+{
+    if (packet_bytes == 2)
+        return MAX_COMM_PACK_SIZE - 1;
+    return max_frame < 2 ? MAX_COMM_PACK_SIZE_4 : max_frame;
+}
+
+// command byte, plus the request id with -proto 2 and the session with 3
+int frame_overhead()
+{
+    return proto >= 3 ? 7 : (proto >= 2 ? 5 : 1);
+}
+
+// puts the length prefix, command byte and request id in front of a
+// payload of len bytes, returns the header size
+int put_frame_header(byte *h, const int t, const long len)
+{
+    int hl = put_packet_len(h, len + frame_overhead());
+    h[hl++] = t;
+    if (proto >= 2)
+    {
+        put_u32(h + hl, cur_id);
+        hl += 4;
+    }
+    if (proto >= 3)
+    {
+        h[hl++] = (cur_session >> 8) & 0xff;
+        h[hl++] = cur_session & 0xff;
+    }
+    return hl;
+}
+
+// Requests are read by a thread of their own and queued in the inbox, so
+// the next ones are parsed while the main thread is busy on the bus.
+
+static gpib_port_comm *inbox_head = NULL;
+static gpib_port_comm *inbox_tail = NULL;
+static int inbox_count = 0;
+static lock_t inbox_lock;
+static event_t inbox_ready;
+static event_t inbox_space;
+
+// queues c for the main loop; the reader waits while the inbox is full,
+// driver threads never do
+void inbox_push(gpib_port_comm *c, bool wait)
+{
+    lock_enter(&inbox_lock);
+    while (wait && (inbox_count >= INBOX_MAX))
+    {
+        lock_leave(&inbox_lock);
+        event_wait(&inbox_space, -1);
+        lock_enter(&inbox_lock);
+    }
+    c->next = NULL;
+    if (inbox_tail != NULL)
+        inbox_tail->next = c;
+    else
+        inbox_head = c;
+    inbox_tail = c;
+    inbox_count++;
+    lock_leave(&inbox_lock);
+    event_set(&inbox_ready);
+}
+
+// waits up to ms (forever if ms < 0) for the next request
+gpib_port_comm *inbox_pop(long ms)
+{
+    gpib_port_comm *c;
+
+    lock_enter(&inbox_lock);
+    while (inbox_head == NULL)
+    {
+        lock_leave(&inbox_lock);
+        out_flush();
+        if (!event_wait(&inbox_ready, ms))
+            return NULL;
+        lock_enter(&inbox_lock);
+    }
+    c = inbox_head;
+    inbox_head = c->next;
+    if (inbox_head == NULL)
+        inbox_tail = NULL;
+    inbox_count--;
+    lock_leave(&inbox_lock);
+    event_set(&inbox_space);
+    return c;
+}
+
+// an error answering a request that could not be taken, sent by the main
+// loop like the data of a service request
+static gpib_port_comm *comm_error(unsigned long id, int session, const char *msg)
+{
+    long n = strlen(msg);
+    gpib_port_comm *c = (gpib_port_comm *)malloc(sizeof(gpib_port_comm) + n + 1);
+    if (c == NULL)
+        return NULL;
+
+    c->t = command_error;
+    c->event = true;
+    c->id = id;
+    c->session = session;
+    c->len = n;
+    c->b = (byte *)(c + 1);
+    memcpy(c->b, msg, n + 1);
+    return c;
+}
+
+// Reads one request, NULL at the end of input. A frame that cannot be
+// taken is answered with an error, with the id and session it carries if
+// it is long enough, and dropped.
+gpib_port_comm *read_comm_cmd()
+{
+    static byte *cmd_buf = NULL;
+    static long cmd_size = 0;
+    gpib_port_comm *r;
+    int hl = frame_overhead();
+    long len;
+
+    for (;;)
+    {
+        len = read_cmd(&cmd_buf, &cmd_size);
+        if (len == -1)
+            return NULL;
+        if (len == -2)
+            r = comm_error(0, 0, "Frame too big");
+        else if (len < hl)
+            r = comm_error(0, 0, "Short frame");
+        else if ((r = (gpib_port_comm *)malloc(sizeof(gpib_port_comm) + len - hl + 1)) == NULL)
+            r = comm_error(proto >= 2 ? get_u32(cmd_buf + 1) : 0,
+                           proto >= 3 ? (cmd_buf[5] << 8) | cmd_buf[6] : 0, "Out of memory");
+        else
+            break;
+        if (r != NULL)
+            return r;
+        dbg_print("Error : request dropped, out of memory\n");
+    }
+
+    r->t = cmd_buf[0];
+    r->event = false;
+    r->at = now_us();
+    r->deadline = 0;
+    r->id = proto >= 2 ? get_u32(cmd_buf + 1) : 0;
+    r->session = proto >= 3 ? (cmd_buf[5] << 8) | cmd_buf[6] : 0;
+    r->len = len - hl;
+    r->b = (byte *)(r + 1);
+    memcpy(r->b, cmd_buf + hl, r->len);
+    r->b[r->len] = 0;
+    return r;
+}
+
+void port_reader(void *arg)
+{
+    gpib_port_comm *c;
+
+    (void)arg;
+    while ((c = read_comm_cmd()) != NULL)
+        inbox_push(c, true);
+
+    // end of input, let the main loop shut down
+    c = (gpib_port_comm *)calloc(1, sizeof(gpib_port_comm) + 1);
+    if (c == NULL)
+        exit(0);
+    c->t = command_shutdown;
+    c->event = false;
+    c->b = (byte *)(c + 1);
+    inbox_push(c, true);
+}
+
+bool send_frame(const int t, const byte *s, const long len)
+{
+    byte h[FRAME_HDR_ROOM];
+    return write_frame(h, put_frame_header(h, t, len), s, len) > 0;
+}
+
+// Anything that does not fit into one frame is sent as a sequence of
+// command_read_more frames followed by a final frame of type t.
+bool send_comm_response(const int t, const byte *s, const long len)
+{
+    long chunk = max_frame_size() - frame_overhead();
+    long left = len;
+
+    while (left > chunk)
+    {
+        if (!send_frame(command_read_more, s, chunk))
+            return false;
+        s += chunk;
+        left -= chunk;
+    }
+    return send_frame(t, s, left);
+}
+
+byte *frame_payload(port_frame &f, const long len)
+{
+    if (FRAME_HDR_ROOM + len > f.size)
+    {
+        byte *p = (byte *)realloc(f.buf, FRAME_HDR_ROOM + len);
+        if (p == NULL)
+            return NULL;
+        f.buf = p;
+        f.size = FRAME_HDR_ROOM + len;
+    }
+    return f.buf + FRAME_HDR_ROOM;
+}
+
+// Sends len bytes already sitting at frame_payload(f): the header is put
+// in front of them, so big frames go out without being copied.
+bool send_frame_in_place(port_frame &f, const int t, const long len)
+{
+    byte *payload = f.buf + FRAME_HDR_ROOM;
+    byte *h = payload - packet_bytes - frame_overhead();
+    io_vec v[2];
+
+    if (frame_overhead() + len > max_frame_size())
+        return send_comm_response(t, payload, len);
+
+    put_frame_header(h, t, len);
+    if (len < ZERO_COPY_MIN)
+        return write_frame(h, payload - h, payload, len) > 0;
+
+    v[0].base = out_buf; v[0].len = out_len;
+    v[1].base = h;       v[1].len = payload - h + len;
+    out_len = 0;
+    return write_vec(v, 2) > 0;
+}
+
+// errors are always sent, the request is answered by them
+void send_msg_error(const char *s)
+{
+    send_comm_response(command_error, (const byte *)s, strlen(s));
+}
+
+void gpib_shutdown(gpib_dev *dev)
+{
+    out_flush();
+    dev->be->close(dev);
+}
+
+// opens a new session on addr, returns its handle or -1
+int open_session(const char *addr)
+{
+    gpib_dev *d;
+    int i;
+
+    for (i = 1; i < MAX_SESSIONS; i++)
+    {
+        if (sessions[i] == NULL)
+            break;
+    }
+    if ((i >= MAX_SESSIONS) || (strlen(addr) >= sizeof(d->addr)))
+        return -1;
+
+    d = (gpib_dev *)malloc(sizeof(gpib_dev));
+    if (d == NULL)
+        return -1;
+    gpib_dev_init(d, port_backend);
+    strcpy(d->addr, addr);
+    d->handle = i;
+    d->on_receive = port_on_receive;
+    d->on_complete = port_on_complete;
+    if ((d->be->open(d) != gpib_ok) || (d->be->clear(d) != gpib_ok)
+        || (srq && (port_enable_srq(d, true) != gpib_ok)))
+    {
+        d->be->cleanup(d, "Unable to open session");
+        free(d);
+        return -1;
+    }
+
+    sessions[i] = d;
+    tmo_load(i);
+    return i;
+}
+
+void close_session(int s)
+{
+    if ((s <= 0) || (s >= MAX_SESSIONS) || (sessions[s] == NULL))
+        return;
+    tmo_save(s);
+    gpib_shutdown(sessions[s]);
+    free(sessions[s]);
+    sessions[s] = NULL;
+}
+
+// closes all sessions opened through the port
+void close_sessions()
+{
+    int i;
+    for (i = 1; i < MAX_SESSIONS; i++)
+        close_session(i);
+}
+
+gpib_dev *find_session(int s)
+{
+    if ((s < 0) || (s >= MAX_SESSIONS))
+        return NULL;
+    return sessions[s];
+}
+
+// Bus requests run as jobs, one at a time per session. The main loop
+// starts a transfer and goes back to the inbox; the backend reports the
+// end of it with an io_done event, which moves the job on. Stdin parsing,
+// response delivery and transfers of other sessions carry on meanwhile.
+
+enum
+{
+    job_idle,
+    job_write,
+    job_read,
+    job_delay                       // batch delay, ends at port_job.wake
+};
+
+#define io_pending  -1              // the transfer is in flight
+#define job_done    -2              // request answered, the session is free
+#define job_failed  -3              // device error, cleaned up
+#define batch_bad   -4              // batch ended by a malformed operation
+                                    // or out of memory, not by the bus
+
+#define IO_ERROR_MAX     165        // bytes of a command_io_error payload
+#define JOURNAL_MAX      4096       // bytes of the setup journal of a session
+#define RECONNECT_MIN_MS 100        // first wait before opening a lost
+#define RECONNECT_MAX_MS 5000       // session again, doubled up to this
+
+struct port_job
+{
+    gpib_port_comm *req;            // request being served, NULL if idle
+    gpib_port_comm *head, *tail;    // requests waiting for the session
+    int step;
+    port_frame f;                   // response, read into in place
+    long pos, out;                  // batch: next operation, reply size
+    unsigned long index, count;
+    u64 wake;
+    int blk;                        // block read: state, data left and
+    long blk_left;                  // header bytes or length digits read,
+    int blk_n;                      // digits of the length
+    byte blk_hdr[10];
+    int xform;                      // response transform of the session,
+    wave_fmt wave;                  // its samples with xform_wave,
+    bool ra;                        // read ahead response in f, ra_cnt
+    long ra_cnt;                    // bytes
+    long keep;                      // bytes of a number cut by a chunk
+    bool bad;                       // and a malformed number was seen
+    port_frame x;                   // transformed response
+    byte *co;                       // writes joined into one transfer,
+    long co_len, co_size;           // see co_add
+    bool co_nl;                     // one of them ended with '\n'
+    u64 co_due;                     // end of the window, 0 = send now
+    gpib_port_comm *co_req;         // the write carrying them, with the id
+    unsigned long co_id;            // of the last one
+    int ops;                        // batch: operations in the transfer
+    bool held;                      // the request was held, not sent
+    u64 begin_at, io_at;            // start of the request and transfer,
+    u64 bus_us, bytes;              // their time on the bus, bytes moved
+    bool tmo;                       // and if one timed out
+    long tmo_cur;                   // timeout set on the device, 0 = as
+                                    // opened, see tmo_pick
+    char tmo_hdr[32];               // header of the last query written,
+    bool tmo_next;                  // answered by the next read
+    bool tmo_more;                  // the last read ended without END
+    struct tmo_entry *tmo_e;        // learning from the read in flight
+    const char *cancel;             // error ending the request, see job_abort
+    bool srq;                       // service requests enabled, restored by
+                                    // session_reopen
+    byte *jr;                       // journal of command_setup messages,
+    long jr_len, jr_size;           // <len:4><data>, see session_reopen
+    bool down;                      // lost, opened again at retry_at, see
+    u64 down_at, retry_at;          // job_retry
+    long retry_ms;
+    bool reopening;                 // session_reopen runs on a thread,
+    bool ro_srq;                    // with a copy of srq and the journal
+    byte *ro_jr;
+    long ro_jr_len;
+    gpib_port_comm done;            // io_done event, [status:1][cnt:4]
+    byte done_b[8];
+    gpib_port_comm reopened;        // reopen_done event, [ok:1]
+    byte reopened_b[2];
+};
+
+static port_job jobs[MAX_SESSIONS];
+static int jobs_busy = 0;           // sessions with a request in progress
+static unsigned long ra_hits = 0;   // reads answered from a read ahead
+static unsigned long ra_misses = 0; // read aheads dropped or timed out
+static int co_pending = 0;          // sessions holding joined writes
+static bool deadlines = false;      // a request with a deadline was seen
+static int sessions_down = 0;       // lost sessions waiting for job_retry
+static int reopens = 0;             // session_reopen threads running
+static unsigned long co_writes = 0; // writes joined with others
+static unsigned long co_sends = 0;  // transfers carrying them
+
+// per session and bus command, see port_stats
+struct cmd_stats
+{
+    unsigned long count, timeouts;
+    u64 bytes;
+    hist queue, bus, total;         // us from read to start, on the bus,
+};                                  // from read to the answer
+
+static cmd_stats *stats[MAX_SESSIONS][command_read_block + 1];
+
+// a message ending with '?', whose response can be read ahead
+bool is_query(const byte *b, long len)
+{
+    while ((len > 0) && ((b[len - 1] == '\n') || (b[len - 1] == '\r') || (b[len - 1] == ' ')))
+        len--;
+    return (len > 0) && (b[len - 1] == '?');
+}
+
+/*
+ *  Adaptive timeouts, -tmo_adapt N: the time a device takes to answer is
+ *  learned per session and command header, "MEAS:VOLT?" of "MEAS:VOLT?
+ *  (@101)", and the read of an answer gets N times its p99 as timeout,
+ *  at least -tmo_min ms. Until TMO_LEARN answers are seen, the timeout
+ *  the device was opened with is kept. A read that times out doubles the
+ *  timeout of its header until one succeeds, so a command that got slower
+ *  is not cut short from then on. command_set_timeout overrides it for
+ *  a header, or for the whole session with an empty one. With -cache, the
+ *  timeouts learned for an instrument are kept in its inventory entry and
+ *  used from the start the next time it is opened, see tmo_save.
+ */
+#define TMO_HEADERS 16              // headers learned per session
+#define TMO_LEARN   8               // answers seen before adapting
+#define TMO_BOOST   8               // max doublings after timeouts
+
+struct tmo_entry
+{
+    char hdr[32];                   // "" = unused
+    long fixed;                     // set by command_set_timeout, 0 = none
+    int boost;                      // doublings after timeouts
+    long seed;                      // learned before, see tmo_load
+    u64 used;                       // last use, the oldest one is replaced
+    hist h;                         // us from the start of a read to its end
+};
+
+struct tmo_table
+{
+    long fixed;                     // of the session, 0 = as opened
+    tmo_entry e[TMO_HEADERS];
+};
+
+static tmo_table *tmos[MAX_SESSIONS];
+
+// header of the last command of message b, upper case, without the root ':'
+void tmo_header(char *h, const byte *b, long len)
+{
+    long i, k = 0, n = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if (b[i] == ';')
+            k = i + 1;
+    }
+    while ((k < len) && ((b[k] == ' ') || (b[k] == ':')))
+        k++;
+    for (; (k < len) && (b[k] > ' ') && (n < 31); k++)
+        h[n++] = (b[k] >= 'a') && (b[k] <= 'z') ? b[k] - 'a' + 'A' : b[k];
+    h[n] = '\0';
+}
+
+tmo_table *tmo_table_of(int s)
+{
+    if (tmos[s] == NULL)
+        tmos[s] = (tmo_table *)calloc(1, sizeof(tmo_table));
+    return tmos[s];
+}
+
+// entry of header h, a new one replacing the oldest if add
+tmo_entry *tmo_find(int s, const char *h, bool add)
+{
+    tmo_table *t = add ? tmo_table_of(s) : tmos[s];
+    tmo_entry *e = NULL;
+    int i;
+
+    if ((t == NULL) || (h[0] == '\0'))
+        return NULL;
+    for (i = 0; i < TMO_HEADERS; i++)
+    {
+        if (strcmp(t->e[i].hdr, h) == 0)
+            return &t->e[i];
+        if ((e == NULL) || (t->e[i].used < e->used))
+            e = &t->e[i];
+    }
+    if (!add)
+        return NULL;
+    memset(e, 0, sizeof(*e));
+    strcpy(e->hdr, h);
+    return e;
+}
+
+// N x p99 of the answers to e in ms, at least tmo_min
+long tmo_learned(const tmo_entry *e)
+{
+    long ms = (long)((hist_percentile(&e->h, 99) * tmo_adapt + 999) / 1000);
+    return ms < tmo_min ? tmo_min : ms;
+}
+
+// timeout in ms for a read answering e, 0 for the one the device was
+// opened with
+long tmo_of(int s, tmo_entry *e)
+{
+    long def = tmos[s] != NULL ? tmos[s]->fixed : 0;
+    long ms, max = (def > 0) && (def < tmo_max) ? def : tmo_max;
+    int i;
+
+    if (e == NULL)
+        return def;
+    e->used = now_us();
+    if (e->fixed > 0)
+        return e->fixed;
+    if (tmo_adapt <= 0)
+        return def;
+    if (e->h.count >= TMO_LEARN)
+        ms = tmo_learned(e);
+    else if (e->seed > 0)
+        ms = e->seed;
+    else
+        return def;
+    for (i = 0; (i < e->boost) && (ms < max); i++)
+        ms <<= 1;
+    return ms > max ? max : ms;
+}
+
+// Sets the timeout of the transfer about to start on session s: writes
+// and reads of something else than an answer get the one of the session,
+// the read of an answer the one of its header, the rest of an answer
+// keeps it.
+void tmo_pick(gpib_dev *dev, bool wr, const byte *buf, long len)
+{
+    port_job &j = jobs[dev->handle];
+    const gpib_backend *be = dev->be;
+    int s = dev->handle;
+    u64 now = now_us();
+    long ms, left;
+
+    j.tmo_e = NULL;
+    if (wr)
+    {
+        j.tmo_next = is_query(buf, len);
+        if (j.tmo_next)
+            tmo_header(j.tmo_hdr, buf, len);
+        ms = tmo_of(s, NULL);
+    }
+    else if (j.tmo_next)
+    {
+        j.tmo_next = false;
+        j.tmo_e = tmo_find(s, j.tmo_hdr, tmo_adapt > 0);
+        ms = tmo_of(s, j.tmo_e);
+    }
+    else if (j.tmo_more)
+        ms = j.tmo_cur;
+    else
+        ms = tmo_of(s, NULL);
+
+    // nor does a transfer outlast the deadline of its request, which is
+    // then not learned from
+    if ((j.req != NULL) && (j.req->deadline != 0))
+    {
+        left = j.req->deadline > now ? (long)((j.req->deadline - now + 999) / 1000) : 1;
+        if ((ms == 0) || (left < ms))
+        {
+            ms = left;
+            j.tmo_e = NULL;
+        }
+    }
+
+    if ((ms == j.tmo_cur) || (be->set_timeout == NULL))
+        return;
+    if (be->set_timeout(dev, ms) == gpib_ok)
+        j.tmo_cur = ms;
+    else
+        tracef(TRACE_ERROR, "unable to set a timeout of %ld ms", ms);
+}
+
+// learns from the read of session s that ended
+void tmo_done(int s, int status)
+{
+    port_job &j = jobs[s];
+    tmo_entry *e = j.tmo_e;
+
+    j.tmo_more = (status == gpib_ok) && !sessions[s]->end;
+    j.tmo_e = NULL;
+    if ((e == NULL) || (j.cancel != NULL))
+        return;
+    if (status == gpib_ok)
+    {
+        hist_add(&e->h, now_us() - j.io_at);
+        e->boost = 0;
+    }
+    else if ((status == gpib_timeout) && (e->boost < TMO_BOOST))
+        e->boost++;
+}
+
+// command_set_timeout: [ms:4][header], ms 0 removes the override
+bool tmo_set(int s, const gpib_port_comm &c)
+{
+    char h[32];
+    tmo_entry *e;
+    long ms = (long)get_u32(c.b);
+
+    tmo_header(h, c.b + 4, c.len - 4);
+    if (h[0] == '\0')
+    {
+        if (tmo_table_of(s) == NULL)
+            return false;
+        tmos[s]->fixed = ms;
+        return true;
+    }
+    e = tmo_find(s, h, true);
+    if (e == NULL)
+        return false;
+    e->fixed = ms;
+    e->used = now_us();
+    return true;
+}
+
+// Keeps the timeouts learned on session s in the settings of the inventory
+// entry of its device, "<header>=<ms> ...", when it is closed. Only the
+// instruments -ls found have an entry.
+void tmo_save(int s)
+{
+    tmo_table *t = tmos[s];
+    char set[sizeof(((inv_entry *)0)->settings)];
+    inv_entry *e;
+    long n = 0, k, ms;
+    int i;
+
+    if ((inv_path[0] == '\0') || (tmo_adapt <= 0) || (t == NULL) || (sessions[s] == NULL))
+        return;
+    set[0] = '\0';
+    for (i = 0; i < TMO_HEADERS; i++)
+    {
+        if (t->e[i].hdr[0] == '\0')
+            continue;
+        ms = t->e[i].h.count >= TMO_LEARN ? tmo_learned(&t->e[i]) : t->e[i].seed;
+        if (ms <= 0)
+            continue;
+        k = snprintf(set + n, sizeof(set) - n, "%s%s=%ld", n > 0 ? " " : "", t->e[i].hdr, ms);
+        if ((k < 0) || (k >= (long)sizeof(set) - n))
+        {
+            set[n] = '\0';
+            break;
+        }
+        n += k;
+    }
+
+    if (!inv_load() || ((e = inv_find(sessions[s]->addr)) == NULL)
+        || (strcmp(e->settings, set) == 0))
+        return;
+    strcpy(e->settings, set);
+    if (!inv_save())
+        tracef(TRACE_ERROR, "unable to write %s", inv_path);
+}
+
+// takes up the timeouts tmo_save kept for the device of session s, used
+// until it has answered TMO_LEARN times
+void tmo_load(int s)
+{
+    char set[sizeof(((inv_entry *)0)->settings)], *p, *q;
+    inv_entry *e;
+    tmo_entry *te;
+
+    if ((inv_path[0] == '\0') || (tmo_adapt <= 0) || !inv_load()
+        || ((e = inv_find(sessions[s]->addr)) == NULL))
+        return;
+    strcpy(set, e->settings);
+    for (p = strtok(set, " "); p != NULL; p = strtok(NULL, " "))
+    {
+        q = strrchr(p, '=');
+        if ((q == NULL) || (q == p) || (q - p >= (long)sizeof(te->hdr)))
+            continue;
+        *q = '\0';
+        te = tmo_find(s, p, true);
+        if (te != NULL)
+        {
+            te->seed = atol(q + 1);
+            te->used = now_us();
+        }
+    }
+    if (tmos[s] != NULL)
+        tracef(TRACE_INFO, "timeouts of %s: %s", sessions[s]->addr, e->settings);
+}
+
+// forgets what session s learned, when it is closed
+void tmo_reset(int s)
+{
+    port_job &j = jobs[s];
+
+    free(tmos[s]);
+    tmos[s] = NULL;
+    j.tmo_cur = 0;
+    j.tmo_next = false;
+    j.tmo_more = false;
+    j.tmo_e = NULL;
+}
+
+// Starts a transfer. Returns io_pending when the backend reports the end
+// through dev->on_complete; without async calls the transfer runs right
+// away and its status is returned, with the count in *cnt.
+int io_start(gpib_dev *dev, bool wr, byte *buf, long len, long *cnt)
+{
+    const gpib_backend *be = dev->be;
+    int r;
+
+    *cnt = 0;
+    tmo_pick(dev, wr, buf, len);
+    jobs[dev->handle].io_at = now_us();
+    if ((be->write_async == NULL) || (be->read_async == NULL))
+    {
+        out_flush();
+        return wr ? be->write(dev, buf, len, cnt) : be->read(dev, buf, len, cnt);
+    }
+    r = wr ? be->write_async(dev, buf, len) : be->read_async(dev, buf, len);
+    return r == gpib_ok ? io_pending : r;
+}
+
+// message of a transfer that failed with status
+const char *io_msg(bool wr, int status)
+{
+    if (status == gpib_timeout)
+        return wr ? "Write timed out" : "Read timed out";
+    if (status == gpib_no_listener)
+        return "No listener";
+    return wr ? "Unable to write to device" : "Unable to read data from device";
+}
+
+// puts <class:1><code:4><message> of a failure at b, returns its size;
+// b needs IO_ERROR_MAX bytes
+long put_io_error(byte *b, int status, long code, const char *msg)
+{
+    long n = strlen(msg);
+
+    if (n > IO_ERROR_MAX - 5)
+        n = IO_ERROR_MAX - 5;
+    b[0] = status;
+    put_u32(b + 1, (unsigned long)code);
+    memcpy(b + 5, msg, n);
+    return 5 + n;
+}
+
+void send_io_error(int status, long code, const char *msg)
+{
+    byte b[IO_ERROR_MAX];
+    send_comm_response(command_io_error, b, put_io_error(b, status, code, msg));
+}
+
+// appends message b to the setup journal of j, clears it for len 0
+bool journal_add(port_job &j, const byte *b, long len)
+{
+    long n = j.jr_len + 4 + len;
+
+    if (len == 0)
+    {
+        j.jr_len = 0;
+        return true;
+    }
+    if (n > JOURNAL_MAX)
+        return false;
+    if (n > j.jr_size)
+    {
+        byte *p = (byte *)realloc(j.jr, n);
+        if (p == NULL)
+            return false;
+        j.jr = p;
+        j.jr_size = n;
+    }
+    put_u32(j.jr + j.jr_len, len);
+    memcpy(j.jr + j.jr_len + 4, b, len);
+    j.jr_len = n;
+    return true;
+}
+
+// Opens session s again on its address after a fatal error, as it was
+// set up by open_session, and replays its setup journal. Returns false
+// if that fails too. Runs on a thread of its own, see job_retry: it only
+// reads the copies job_retry made, the main loop leaves the rest alone.
+bool session_reopen(int s)
+{
+    gpib_dev *d = sessions[s];
+    port_job &j = jobs[s];
+    long p, n, cnt;
+
+    tracef(TRACE_ERROR, "reopening %s", d->addr);
+    d->be->close(d);
+    if ((d->be->open(d) != gpib_ok) || (d->be->clear(d) != gpib_ok))
+        return false;
+    for (p = 0; p < j.ro_jr_len; p += 4 + n)
+    {
+        n = get_u32(j.ro_jr + p);
+        if (d->be->write(d, j.ro_jr + p + 4, n, &cnt) != gpib_ok)
+            return false;
+    }
+    if (j.ro_jr_len > 0)
+        tracef(TRACE_INFO, "setup of %s replayed, %ld bytes", d->addr, j.ro_jr_len);
+    return !j.ro_srq || (d->be->enable_srq(d, true) == gpib_ok);
+}
+
+// drops what the port keeps for session s, once it is closed
+void session_forget(int s)
+{
+    port_job &j = jobs[s];
+
+    j.xform = xform_none;
+    j.srq = false;
+    j.jr_len = 0;
+    tmo_reset(s);
+}
+
+// session s is lost, requests wait for job_retry to open it again, at
+// once the first time
+void job_down(int s)
+{
+    port_job &j = jobs[s];
+
+    j.down = true;
+    j.down_at = now_us();
+    j.retry_ms = RECONNECT_MIN_MS / 2;
+    j.retry_at = j.down_at;
+    sessions_down++;
+}
+
+// Keeps the session of dev after a transfer failed with *status: after a
+// bus error the device is cleared, after a fatal one the session is opened
+// again by job_retry, with -reconnect until it works. m gets the message
+// for the client, *status the class.
+void io_recover(gpib_dev *dev, int *status, const char *msg, char *m)
+{
+    long code = dev->code;
+
+    sprintf(m, "%.100s", msg);
+    if ((*status == gpib_error) && (dev->be->clear(dev) != gpib_ok))
+        *status = gpib_fatal;
+    if (*status == gpib_fatal)
+    {
+        sprintf(m, "%.100s, %s", msg, reconnect_s > 0 ? "reconnecting" : "reopening");
+        job_down(dev->handle);
+    }
+    tracef(TRACE_ERROR, "%s (%ld)", m, code);
+}
+
+// A write is not answered; with -proto 1, which has no ids, an error for
+// it would be taken for the answer of the next read, so it is only traced.
+bool unanswered(const gpib_port_comm *c)
+{
+    return (c->t == command_write_to_gpib) && (proto < 2);
+}
+
+// recovers from a failure whose request is already answered
+int job_recover(gpib_dev *dev, int status, const char *msg)
+{
+    char m[160];
+
+    io_recover(dev, &status, msg, m);
+    return job_done;
+}
+
+// Answers the request with command_io_error for a failed transfer of dev,
+// see io_recover.
+int job_error(gpib_dev *dev, int status, const char *msg)
+{
+    long code = dev->code;
+    char m[160];
+
+    io_recover(dev, &status, msg, m);
+    send_io_error(status, code, m);
+    return job_done;
+}
+
+/*
+ *  Write coalescing, -coalesce N: a write is held for up to N us and goes
+ *  out with the writes that follow it in that time as one transfer,
+ *  "A;:B;:C". The ':' starts each command at the root of the SCPI tree,
+ *  as it would on its own. Held writes are sent before any other request
+ *  of the session; consecutive writes of a batch are joined the same way.
+ *  The transfer carries the id of the last write it joins, which its error
+ *  echoes. A write with a deadline is not joined.
+ */
+#define COALESCE_MAX 1024           // bytes of one joined transfer
+
+// appends message b to j.co, without its line end
+bool co_join(port_job &j, const byte *b, long len)
+{
+    long n;
+
+    while ((len > 0) && ((b[len - 1] == '\n') || (b[len - 1] == '\r')))
+    {
+        if (b[len - 1] == '\n')
+            j.co_nl = true;
+        len--;
+    }
+    n = j.co_len + len + 3;
+    if (n > j.co_size)
+    {
+        byte *p;
+        if (n < COALESCE_MAX + 3)
+            n = COALESCE_MAX + 3;
+        p = (byte *)realloc(j.co, n);
+        if (p == NULL)
+            return false;
+        j.co = p;
+        j.co_size = n;
+    }
+    if ((j.co_len > 0) && (len > 0))
+    {
+        j.co[j.co_len++] = ';';
+        if ((b[0] != ':') && (b[0] != '*'))
+            j.co[j.co_len++] = ':';
+    }
+    memcpy(j.co + j.co_len, b, len);
+    j.co_len += len;
+    return true;
+}
+
+// c is a write that can join the ones held in j; one with a deadline is
+// sent on its own
+bool co_joins(port_job &j, const gpib_port_comm *c)
+{
+    return (c->t == command_write_to_gpib) && (c->len > 0) && (c->deadline == 0)
+        && (j.co_len + c->len + 2 <= COALESCE_MAX);
+}
+
+// holds write c of session s, see co_check
+int co_add(int s, gpib_port_comm *c)
+{
+    port_job &j = jobs[s];
+
+    if (j.co_len == 0)
+    {
+        j.co_due = now_us() + coalesce_us;
+        co_pending++;
+    }
+    if (!co_join(j, c->b, c->len))
+    {
+        sessions[s]->be->cleanup(sessions[s], "Out of memory");
+        return job_failed;
+    }
+    co_writes++;
+    j.co_id = c->id;
+    j.held = true;
+    // the response of a query is read ahead only once it is written
+    if (read_ahead && is_query(c->b, c->len))
+        j.co_due = 0;
+    return job_done;
+}
+
+// Queues the writes held by session s in front of its next request once
+// they have to go out: the window ended, or that request is not a write
+// that can join them. Returns 1 if out of memory.
+int co_check(int s)
+{
+    port_job &j = jobs[s];
+    gpib_port_comm *c = j.head, *w;
+
+    if (j.co_len == 0)
+        return 0;
+    if ((j.co_due != 0) && (c != NULL ? co_joins(j, c) : now_us() < j.co_due))
+        return 0;
+
+    if (j.co_nl)
+        j.co[j.co_len++] = '\n';
+    w = (gpib_port_comm *)malloc(sizeof(gpib_port_comm) + j.co_len + 1);
+    if (w == NULL)
+    {
+        sessions[s]->be->cleanup(sessions[s], "Out of memory");
+        return 1;
+    }
+    w->t = command_write_to_gpib;
+    w->event = false;
+    w->at = j.co_due != 0 ? j.co_due - coalesce_us : now_us();
+    w->deadline = 0;
+    w->id = j.co_id;
+    w->session = s;
+    w->len = j.co_len;
+    w->b = (byte *)(w + 1);
+    memcpy(w->b, j.co, j.co_len);
+    w->b[w->len] = 0;
+    w->next = c;
+    j.head = w;
+    if (j.tail == NULL)
+        j.tail = w;
+
+    j.co_req = w;
+    j.co_len = 0;
+    j.co_nl = false;
+    co_pending--;
+    co_sends++;
+    return 0;
+}
+
+// Joins the writes of a batch from j.pos on, up to and including a
+// query, into j.co. Returns the number of operations joined, 0 if out of
+// memory.
+int batch_join(port_job &j, const byte *b, long len)
+{
+    long pos = j.pos, n;
+    int ops = 0;
+
+    if (coalesce_us <= 0)
+        return 1;
+    while ((len - pos >= 5) && ((b[pos] == batch_op_write) || (b[pos] == batch_op_query)))
+    {
+        n = get_u32(b + pos + 1);
+        if ((n > len - pos - 5) || ((ops > 0) && (j.co_len + n + 2 > COALESCE_MAX)))
+            break;
+        if (!co_join(j, b + pos + 5, n))
+            return 0;
+        ops++;
+        if (b[pos] == batch_op_query)
+            break;
+        pos += 5 + n;
+    }
+    if (j.co_nl)
+        j.co[j.co_len++] = '\n';
+    return ops;
+}
+
+/*
+ *  Runs a list of operations, each one <op:1><len:4><data:len>, and
+ *  answers with a single command_batch frame:
+ *      <failed:4><count:4> followed by <len:4><data> per query result
+ *  failed is the index of the first failing operation, or BATCH_OK.
+ *  Operations after a failure are not run. A failed batch goes on with
+ *  <class:1><code:4><message> as command_io_error, class 0 for an
+ *  operation that could not be run at all.
+ */
+int batch_end(port_job &j, gpib_dev *dev, int status, const char *msg)
+{
+    long code = dev->code;
+    char m[160] = "";
+    byte *p;
+
+    if (status == batch_bad)
+    {
+        status = gpib_ok;
+        code = 0;
+        sprintf(m, "%.100s", msg);
+    }
+    else if (status != gpib_ok)
+        io_recover(dev, &status, msg, m);
+
+    p = frame_payload(j.f, j.out + IO_ERROR_MAX);
+    if (p == NULL)
+    {
+        send_msg_error("Out of memory");
+        return job_done;
+    }
+    put_u32(p, j.pos < j.req->len ? j.index : BATCH_OK);
+    put_u32(p + 4, j.count);
+    if (j.pos < j.req->len)
+        j.out += put_io_error(p + j.out, status, code, m);
+    send_frame_in_place(j.f, command_batch, j.out);
+    return job_done;
+}
+
+// takes the result of the operation that ended, starts the next one
+int batch_step(port_job &j, gpib_dev *dev, int status, long cnt, long *next)
+{
+    const byte *b = j.req->b;
+    long len = j.req->len, n;
+    byte *p;
+
+    if (status != gpib_ok)
+        return batch_end(j, dev, status, io_msg(j.step == job_write, status));
+
+    switch (j.step)
+    {
+    case job_write:
+        // on to the last operation of a joined transfer
+        for (; j.ops > 1; j.ops--)
+        {
+            j.pos += 5 + get_u32(b + j.pos + 1);
+            j.index++;
+        }
+        if (b[j.pos] != batch_op_query)
+            break;
+        p = frame_payload(j.f, j.out + 4 + read_size);
+        if (p == NULL)
+            return batch_end(j, dev, batch_bad, "Out of memory");
+        j.step = job_read;
+        return io_start(dev, false, p + j.out + 4, read_size, next);
+    case job_read:
+        put_u32(j.f.buf + FRAME_HDR_ROOM + j.out, cnt);
+        j.out += 4 + cnt;
+        j.count++;
+        break;
+    }
+    if (j.step != job_idle)
+    {
+        j.pos += 5 + get_u32(b + j.pos + 1);
+        j.index++;
+    }
+
+    j.step = job_idle;
+    if (len - j.pos < 5)
+        return batch_end(j, dev, j.pos < len ? batch_bad : gpib_ok, "Bad batch operation");
+    n = get_u32(b + j.pos + 1);
+    if (n > len - j.pos - 5)
+        return batch_end(j, dev, batch_bad, "Bad batch operation");
+
+    switch (b[j.pos])
+    {
+    case batch_op_write:
+    case batch_op_query:
+        j.step = job_write;
+        j.ops = batch_join(j, b, len);
+        n = j.co_len;
+        j.co_len = 0;
+        j.co_nl = false;
+        if (j.ops == 0)
+            return batch_end(j, dev, batch_bad, "Out of memory");
+        if (j.ops == 1)
+            return io_start(dev, true, (byte *)b + j.pos + 5, get_u32(b + j.pos + 1), next);
+        co_writes += j.ops;
+        co_sends++;
+        return io_start(dev, true, j.co, n, next);
+    case batch_op_delay:
+        j.step = job_delay;
+        j.wake = now_us() + (n >= 4 ? (u64)get_u32(b + j.pos + 5) * 1000 : 0);
+        return io_pending;
+    default:
+        return batch_end(j, dev, batch_bad, "Bad batch operation");
+    }
+}
+
+// starts a read of up to read_size bytes into the response frame, after
+// the bytes kept from the previous chunk
+int read_start(port_job &j, gpib_dev *dev, long *cnt)
+{
+    byte *p = frame_payload(j.f, j.keep + read_size);
+    if (p == NULL)
+    {
+        dev->be->cleanup(dev, "Out of memory");
+        return job_failed;
+    }
+    j.step = job_read;
+    return io_start(dev, false, p + j.keep, read_size, cnt);
+}
+
+// Sends the response read into j.f as a frame of type t, through the
+// transform of the session. Until the last chunk, a number or sample cut
+// by the chunk boundary is kept for the next one. A malformed response is
+// answered with an error after its last chunk.
+void send_data(port_job &j, const int t, long cnt, bool last)
+{
+    byte *in = j.f.buf + FRAME_HDR_ROOM;
+    int size = xform_size(j.xform);
+    long n = j.keep + cnt, used = 0, vals = 0;
+    byte *out = NULL;
+
+    if (j.xform == xform_none)
+    {
+        send_frame_in_place(j.f, t, cnt);
+        return;
+    }
+
+    if (j.xform == xform_wave)
+    {
+        vals = n / wave_bytes(j.wave.type);
+        used = vals * wave_bytes(j.wave.type);
+        out = frame_payload(j.x, vals * size);
+        if (out != NULL)
+            convert_wave(in, vals, &j.wave, out);
+    }
+    else
+    {
+        if (!j.bad)
+            out = frame_payload(j.x, (n / 2 + 1) * size);
+        if (out != NULL)
+            vals = decode_ascii(in, n, j.xform, last, out, &used);
+    }
+
+    j.keep = last ? 0 : n - used;
+    if ((out == NULL) || (vals < 0) || (j.keep > XFORM_KEEP_MAX))
+    {
+        j.bad = true;
+        j.keep = 0;
+    }
+    else
+        memmove(in, in + used, j.keep);
+
+    if (last && j.bad)
+        send_msg_error("Malformed number in the response");
+    else if (last || (!j.bad && (vals > 0)))
+        send_frame_in_place(j.x, t, vals * size);
+}
+
+/*
+ *  IEEE 488.2 block: #<n><len:n digits><data:len>, or #0<data> up to
+ *  END. Anything in front of '#' (a command header) is skipped. The data
+ *  is read in chunks of read_size straight into the response frame and
+ *  sent as command_read_more frames, the last one as command_read_block;
+ *  what follows a definite block (usually '\n') is read and dropped.
+ */
+enum
+{
+    blk_start,
+    blk_hash,                       // looking for '#'
+    blk_digits,                     // n
+    blk_len,
+    blk_data,
+    blk_tail
+};
+
+#define BLOCK_SKIP_MAX 256          // max bytes in front of '#'
+
+int block_read(port_job &j, gpib_dev *dev, long len, long *next)
+{
+    byte *p = frame_payload(j.f, j.keep + read_size);
+    if (p == NULL)
+    {
+        dev->be->cleanup(dev, "Out of memory");
+        return job_failed;
+    }
+    j.step = job_read;
+    return io_start(dev, false, p + j.keep, len < read_size ? len : read_size, next);
+}
+
+// answers with an error, the rest of the response is dropped
+int block_fail(port_job &j, gpib_dev *dev, const char *msg, long *next)
+{
+    send_msg_error(msg);
+    if (dev->end)
+        return job_done;
+    j.blk = blk_tail;
+    return block_read(j, dev, read_size, next);
+}
+
+int block_step(port_job &j, gpib_dev *dev, int status, long cnt, long *next)
+{
+    long n, i;
+
+    if (status != gpib_ok)
+    {
+        // the block, or the error ending it, is sent already
+        if (j.blk == blk_tail)
+            return job_recover(dev, status, io_msg(false, status));
+        return job_error(dev, status, io_msg(j.step == job_write, status));
+    }
+
+    j.step = job_read;
+    switch (j.blk)
+    {
+    case blk_start:     // the request is written
+        j.blk = blk_hash;
+        j.blk_left = 0;
+        return io_start(dev, false, j.blk_hdr, 2, next);
+    case blk_hash:
+        if ((cnt == 2) && (j.blk_hdr[0] == '#'))
+        {
+            j.blk_hdr[0] = j.blk_hdr[1];
+            cnt = 1;
+        }
+        else if ((((cnt == 2) && (j.blk_hdr[1] == '#')) || ((cnt == 1) && (j.blk_hdr[0] == '#')))
+                 && !dev->end)
+        {
+            j.blk = blk_digits;
+            return io_start(dev, false, j.blk_hdr, 1, next);
+        }
+        else
+        {
+            j.blk_left += cnt;
+            if (dev->end || (cnt == 0) || (j.blk_left > BLOCK_SKIP_MAX))
+                return block_fail(j, dev, "No block in the response", next);
+            return io_start(dev, false, j.blk_hdr, 2, next);
+        }
+        // fall through with n in blk_hdr[0]
+    case blk_digits:
+        if ((cnt != 1) || dev->end || (j.blk_hdr[0] < '0') || (j.blk_hdr[0] > '9'))
+            return block_fail(j, dev, "Malformed block header", next);
+        n = j.blk_hdr[0] - '0';
+        if (n == 0)
+        {
+            j.blk = blk_data;
+            j.blk_left = -1;
+            return block_read(j, dev, read_size, next);
+        }
+        j.blk = blk_len;
+        j.blk_n = (int)n;
+        j.blk_left = 0;
+        return io_start(dev, false, j.blk_hdr, n, next);
+    case blk_len:
+        // the n digits may come in more than one read
+        for (i = j.blk_left; i < j.blk_left + cnt; i++)
+        {
+            if ((j.blk_hdr[i] < '0') || (j.blk_hdr[i] > '9'))
+                return block_fail(j, dev, "Malformed block header", next);
+        }
+        j.blk_left += cnt;
+        if (j.blk_left < j.blk_n)
+        {
+            if (dev->end || (cnt == 0))
+                return block_fail(j, dev, "Malformed block header", next);
+            return io_start(dev, false, j.blk_hdr + j.blk_left, j.blk_n - j.blk_left, next);
+        }
+        n = 0;
+        for (i = 0; i < j.blk_n; i++)
+            n = n * 10 + (j.blk_hdr[i] - '0');
+        if (dev->end && (n > 0))
+            return block_fail(j, dev, "Malformed block header", next);
+        j.blk = blk_data;
+        j.blk_left = n;
+        if (n > 0)
+            return block_read(j, dev, n, next);
+        cnt = 0;
+        break;
+    case blk_data:
+        if (j.blk_left > 0)
+            j.blk_left -= cnt;
+        if ((j.blk_left > 0) && (dev->end || (cnt == 0)))
+        {
+            send_data(j, command_read_more, cnt, false);
+            return block_fail(j, dev, "Block ended early", next);
+        }
+        break;
+    default:            // blk_tail
+        if (dev->end || (cnt == 0))
+            return job_done;
+        return block_read(j, dev, read_size, next);
+    }
+
+    // blk_data
+    if ((j.blk_left != 0) && !((j.blk_left < 0) && (dev->end || (cnt == 0))))
+    {
+        send_data(j, command_read_more, cnt, false);
+        return block_read(j, dev, j.blk_left < 0 ? read_size : j.blk_left, next);
+    }
+    // #0 ends with NL^END, the NL is the terminator and not data
+    if ((j.blk_left < 0) && (cnt > 0) && (j.f.buf[FRAME_HDR_ROOM + j.keep + cnt - 1] == '\n'))
+        cnt--;
+    send_data(j, command_read_block, cnt, true);
+    if (dev->end || (j.blk_left < 0))
+        return job_done;
+    j.blk = blk_tail;
+    return block_read(j, dev, read_size, next);
+}
+
+// Takes the result of the step that just ended and starts the next one,
+// as long as they complete right away.
+int job_step(int s, int status, long cnt)
+{
+    port_job &j = jobs[s];
+    gpib_dev *dev = sessions[s];
+    gpib_port_comm &c = *j.req;
+
+    cur_id = c.id;
+    cur_session = s;
+    while (status >= 0)
+    {
+        if ((j.step == job_write) || (j.step == job_read))
+        {
+            j.bus_us += now_us() - j.io_at;
+            j.bytes += cnt;
+            j.tmo = j.tmo || (status == gpib_timeout);
+        }
+        // a transfer cut short by the deadline of its request
+        if ((status == gpib_timeout) && (c.deadline != 0) && (j.cancel == NULL)
+            && (now_us() + 1000 >= c.deadline))
+            j.cancel = "Deadline exceeded";
+        if (j.step == job_read)
+            tmo_done(s, status);
+        if (j.cancel != NULL)
+        {
+            // whatever the device still has of the request is dropped
+            if (unanswered(&c))
+                tracef(TRACE_ERROR, "%s", j.cancel);
+            else
+                send_msg_error(j.cancel);
+            if (((j.step == job_write) || (j.step == job_read))
+                && (dev->be->clear(dev) != gpib_ok))
+                return job_recover(dev, gpib_fatal, "Unable to clear device");
+            return job_done;
+        }
+        if (c.t == command_batch)
+        {
+            status = batch_step(j, dev, status, cnt, &cnt);
+            continue;
+        }
+        if (c.t == command_read_block)
+        {
+            status = block_step(j, dev, status, cnt, &cnt);
+            continue;
+        }
+
+        if (status != gpib_ok)
+        {
+            // nobody waits for a response read ahead
+            if ((c.t == command_write_to_gpib) && (j.step == job_read))
+            {
+                ra_misses++;
+                if (status == gpib_timeout)
+                    return job_done;
+            }
+            if (unanswered(&c))
+                return job_recover(dev, status, io_msg(j.step == job_write, status));
+            return job_error(dev, status, io_msg(j.step == job_write, status));
+        }
+
+        if (j.step == job_write)
+        {
+            if (c.t == command_setup)
+            {
+                send_comm_response(command_setup, (const byte *)"", 0);
+                return job_done;
+            }
+            if ((c.t == command_write_to_gpib) && !(read_ahead && is_query(c.b, c.len)))
+                return job_done;
+            status = read_start(j, dev, &cnt);
+            continue;
+        }
+
+        // the response of a query written with read_ahead, kept for the
+        // read command that follows
+        if (c.t == command_write_to_gpib)
+        {
+            j.ra = true;
+            j.ra_cnt = cnt;
+            return job_done;
+        }
+
+        if ((c.t == command_read_stream) && !dev->end && (cnt > 0))
+        {
+            send_data(j, command_read_more, cnt, false);
+            status = read_start(j, dev, &cnt);
+            continue;
+        }
+        send_data(j, c.t == command_read_stream ? command_read_stream
+                                                : command_read_from_gpib, cnt, true);
+        return job_done;
+    }
+    return status;
+}
+
+// starts the request at the head of the queue of session s
+int job_begin(int s)
+{
+    port_job &j = jobs[s];
+    gpib_port_comm *c = j.head;
+    gpib_dev *dev = sessions[s];
+    byte h[2];
+    long cnt = 0;
+    int status = gpib_ok;
+    bool joined = c == j.co_req;
+
+    j.head = c->next;
+    if (j.head == NULL)
+        j.tail = NULL;
+    j.req = c;
+    j.step = job_idle;
+    j.keep = 0;
+    j.bad = false;
+    j.co_req = NULL;
+    j.held = false;
+    j.begin_at = now_us();
+    j.bus_us = 0;
+    j.bytes = 0;
+    j.tmo = false;
+    j.cancel = NULL;
+    cur_id = c->id;
+    cur_session = s;
+
+    if (dev == NULL)
+    {
+        send_msg_error("No such session");
+        return job_done;
+    }
+    if ((c->deadline != 0) && (c->deadline <= j.begin_at))
+    {
+        send_msg_error("Deadline exceeded");
+        return job_done;
+    }
+
+    if (j.ra && (c->t == command_read_from_gpib))
+    {
+        ra_hits++;
+        j.ra = false;
+        send_data(j, command_read_from_gpib, j.ra_cnt, true);
+        return job_done;
+    }
+    if (j.ra && (c->t != command_set_xform) && (c->t != command_set_timeout))
+    {
+        // anything else talks to the device, which drops the response
+        ra_misses++;
+        j.ra = false;
+    }
+
+    if ((coalesce_us > 0) && !joined && (c->t == command_write_to_gpib)
+        && (c->len > 0) && (c->len < COALESCE_MAX) && (c->deadline == 0))
+        return co_add(s, c);
+
+    switch (c->t)
+    {
+    case command_write_to_gpib:
+    case command_query:
+        if (c->len < 1)
+            return job_done;
+        j.step = job_write;
+        status = io_start(dev, true, c->b, c->len, &cnt);
+        break;
+    case command_read_block:
+        if (frame_payload(j.f, read_size) == NULL)
+        {
+            dev->be->cleanup(dev, "Out of memory");
+            return job_failed;
+        }
+        j.blk = blk_start;
+        if (c->len > 0)
+        {
+            j.step = job_write;
+            status = io_start(dev, true, c->b, c->len, &cnt);
+        }
+        break;
+    case command_read_stream:
+        if (c->len > 0)
+        {
+            j.step = job_write;
+            status = io_start(dev, true, c->b, c->len, &cnt);
+            break;
+        }
+        // fall through
+    case command_read_from_gpib:
+        status = read_start(j, dev, &cnt);
+        break;
+    case command_batch:
+        j.pos = 0;
+        j.out = 8;
+        j.index = 0;
+        j.count = 0;
+        if (frame_payload(j.f, j.out) == NULL)
+        {
+            dev->be->cleanup(dev, "Out of memory");
+            return job_failed;
+        }
+        break;
+    case command_set_xform:
+        if ((c->len < 1) || ((c->b[0] != xform_none) && (xform_size(c->b[0]) == 0))
+            || ((c->b[0] == xform_wave) && ((c->len < 19) || (wave_bytes(c->b[1]) == 0))))
+        {
+            send_msg_error("Unknown transform");
+            return job_done;
+        }
+        j.xform = c->b[0];
+        if (j.xform == xform_wave)
+        {
+            j.wave.type = c->b[1];
+            j.wave.big = c->b[2] != 0;
+            j.wave.scale = (float)get_f64(c->b + 3);
+            j.wave.offset = (float)get_f64(c->b + 11);
+        }
+        send_comm_response(command_set_xform, h, 0);
+        return job_done;
+    case command_setup:
+        if (!journal_add(j, c->b, c->len))
+        {
+            send_msg_error("Setup journal full");
+            return job_done;
+        }
+        if (c->len < 1)
+        {
+            send_comm_response(command_setup, h, 0);
+            return job_done;
+        }
+        j.step = job_write;
+        status = io_start(dev, true, c->b, c->len, &cnt);
+        break;
+    case command_set_timeout:
+        if (c->len < 4)
+            send_msg_error("Missing timeout");
+        else if (!tmo_set(s, *c))
+            send_msg_error("Out of memory");
+        else
+            send_comm_response(command_set_timeout, h, 0);
+        return job_done;
+    default:    // command_close_session, queued behind the transfers
+        close_session(s);
+        session_forget(s);
+        send_comm_response(command_close_session, h, 0);
+        return job_done;
+    }
+    return job_step(s, status, cnt);
+}
+
+// adds the request that ended to the stats of its session and command
+void stats_add(int s, port_job &j)
+{
+    gpib_port_comm &c = *j.req;
+    cmd_stats *st;
+    u64 now = now_us();
+
+    switch (c.t)
+    {
+    case command_write_to_gpib:
+    case command_read_from_gpib:
+    case command_query:
+    case command_batch:
+    case command_read_stream:
+    case command_read_block:
+        break;
+    default:
+        return;
+    }
+    // held writes are counted with the transfer that carries them
+    if (j.held || (sessions[s] == NULL))
+        return;
+
+    st = stats[s][(int)c.t];
+    if (st == NULL)
+    {
+        st = (cmd_stats *)calloc(1, sizeof(cmd_stats));
+        if (st == NULL)
+            return;
+        stats[s][(int)c.t] = st;
+    }
+    st->count++;
+    st->timeouts += j.tmo;
+    st->bytes += j.bytes;
+    hist_add(&st->queue, j.begin_at - c.at);
+    hist_add(&st->bus, j.bus_us);
+    hist_add(&st->total, now - c.at);
+}
+
+// Moves the job of session s on with the result r of job_begin/job_step
+// and starts the next queued request once it is done. Returns 1 if the
+// device failed.
+int job_run(int s, int r)
+{
+    port_job &j = jobs[s];
+
+    while (r != io_pending)
+    {
+        if (r == job_failed)
+            return 1;
+        stats_add(s, j);
+        free(j.req);
+        j.req = NULL;
+        j.step = job_idle;
+        if (co_check(s) != 0)
+            return 1;
+        if ((j.head == NULL) || j.down)
+        {
+            jobs_busy--;
+            return 0;
+        }
+        r = job_begin(s);
+    }
+    return 0;
+}
+
+// queues a bus request, c is owned by the job from now on
+int job_submit(int s, gpib_port_comm *c)
+{
+    port_job &j = jobs[s];
+
+    c->next = NULL;
+    if (j.tail != NULL)
+        j.tail->next = c;
+    else
+        j.head = c;
+    j.tail = c;
+    if ((j.req != NULL) || j.down)
+        return 0;
+    if (co_check(s) != 0)
+        return 1;
+    jobs_busy++;
+    return job_run(s, job_begin(s));
+}
+
+// Ends the request in progress on session s with error msg. A transfer
+// in flight is stopped and the request ends once it does, see job_step.
+// Returns 1 if the device failed.
+int job_abort(int s, const char *msg)
+{
+    port_job &j = jobs[s];
+    gpib_dev *dev = sessions[s];
+
+    if ((j.req == NULL) || (j.cancel != NULL))
+        return 0;
+    j.cancel = msg;
+    if (j.step == job_delay)
+        return job_run(s, job_step(s, gpib_ok, 0));
+    if ((dev != NULL) && (dev->be->stop != NULL) && (dev->be->stop(dev) != gpib_ok))
+        tracef(TRACE_ERROR, "unable to stop the transfer of session %d", s);
+    return 0;
+}
+
+// Answers the queued requests of session s whose deadline is before now
+// with error msg and drops them, or with now 0 the one with the given id,
+// or all of them. Joined writes, which carry the id of one of them, only
+// go with all. Returns how many.
+int job_drop(int s, u64 now, unsigned long id, bool all, const char *msg)
+{
+    port_job &j = jobs[s];
+    gpib_port_comm **p = &j.head, *c;
+    int n = 0;
+
+    j.tail = NULL;
+    while ((c = *p) != NULL)
+    {
+        if (c == j.co_req ? all
+            : now != 0 ? (c->deadline != 0) && (c->deadline <= now) : all || (c->id == id))
+        {
+            *p = c->next;
+            if (c == j.co_req)
+                j.co_req = NULL;
+            else
+            {
+                cur_id = c->id;
+                cur_session = s;
+                if (unanswered(c))
+                    tracef(TRACE_ERROR, "%s", msg);
+                else
+                    send_msg_error(msg);
+                n++;
+            }
+            free(c);
+            continue;
+        }
+        j.tail = c;
+        p = &c->next;
+    }
+    return n;
+}
+
+// earliest deadline of the requests of j, 0 if none
+u64 job_deadline(const port_job &j)
+{
+    const gpib_port_comm *c;
+    u64 t = 0;
+
+    if ((j.req != NULL) && (j.cancel == NULL))
+        t = j.req->deadline;
+    for (c = j.head; c != NULL; c = c->next)
+    {
+        if ((c->deadline != 0) && ((t == 0) || (c->deadline < t)))
+            t = c->deadline;
+    }
+    return t;
+}
+
+// ends the requests of session s whose deadline has passed
+int job_expire(int s, u64 now)
+{
+    port_job &j = jobs[s];
+
+    job_drop(s, now, 0, false, "Deadline exceeded");
+    if ((j.req != NULL) && (j.req->deadline != 0) && (j.req->deadline <= now))
+        return job_abort(s, "Deadline exceeded");
+    return 0;
+}
+
+// command_cancel: ends request id of session s, or all of them; *n is
+// set to how many
+int job_cancel(int s, unsigned long id, bool all, int *n)
+{
+    port_job &j = jobs[s];
+
+    *n = job_drop(s, 0, id, all, "Cancelled");
+    if ((j.req == NULL) || (j.cancel != NULL) || !(all || (j.req->id == id)))
+        return 0;
+    (*n)++;
+    return job_abort(s, "Cancelled");
+}
+
+// ms until the next batch delay, coalescing window, deadline or reconnect
+// attempt, -1 if there is none
+long job_timeout()
+{
+    u64 now = now_us(), t = 0, w = 0, d;
+    bool any = false, has;
+    int i;
+
+    if ((jobs_busy == 0) && (co_pending == 0) && (sessions_down == 0))
+        return -1;
+    for (i = 0; i < MAX_SESSIONS; i++)
+    {
+        has = true;
+        if (jobs[i].down && jobs[i].reopening)
+            has = false;
+        else if (jobs[i].down)
+            w = jobs[i].retry_at;
+        else if ((jobs[i].req == NULL) && (jobs[i].co_len > 0))
+            w = jobs[i].co_due;
+        else if ((jobs[i].req != NULL) && (jobs[i].step == job_delay))
+            w = jobs[i].wake;
+        else
+            has = false;
+        d = deadlines ? job_deadline(jobs[i]) : 0;
+        if ((d != 0) && (!has || (d < w)))
+        {
+            w = d;
+            has = true;
+        }
+        if (!has)
+            continue;
+        if (w <= now)
+            return 0;
+        if (!any || (w - now < t))
+            t = w - now;
+        any = true;
+    }
+    return any ? (long)((t + 999) / 1000) : -1;
+}
+
+// runs session_reopen off the main loop, which gets the result as a
+// command_reopen_done event
+void reopen_worker(void *arg)
+{
+    gpib_port_comm *c = (gpib_port_comm *)arg;
+
+    c->b[0] = session_reopen(c->session);
+    inbox_push(c, false);
+}
+
+// Starts an attempt to open lost session s again, on a thread of its own
+// as it may take as long as the open timeout of the device. See
+// job_reopened for the end of it.
+int job_retry(int s)
+{
+    port_job &j = jobs[s];
+    gpib_port_comm *c = &j.reopened;
+
+    c->t = command_reopen_done;
+    c->event = true;
+    c->id = 0;
+    c->session = s;
+    c->len = 1;
+    c->b = j.reopened_b;
+    j.reopening = true;
+    reopens++;
+    j.tmo_cur = 0;
+    j.tmo_more = false;
+    j.ra = false;
+    j.ro_srq = j.srq;
+    j.ro_jr_len = j.jr_len;
+    j.ro_jr = j.jr_len > 0 ? (byte *)malloc(j.jr_len) : NULL;
+    if (j.ro_jr_len > 0)
+    {
+        if (j.ro_jr == NULL)
+            return job_reopened(s, false);
+        memcpy(j.ro_jr, j.jr, j.jr_len);
+    }
+    if (thread_start(reopen_worker, c))
+        return 0;
+    c->b[0] = session_reopen(s);
+    return job_reopened(s, c->b[0] != 0);
+}
+
+// Takes the result of an attempt of job_retry. Once session s is back its
+// queued requests go on; without it, after -reconnect s they are answered
+// with an error and the session is closed. Returns 1 if that is the
+// device of the command line.
+int job_reopened(int s, bool ok)
+{
+    port_job &j = jobs[s];
+    u64 now = now_us();
+
+    j.reopening = false;
+    reopens--;
+    free(j.ro_jr);
+    j.ro_jr = NULL;
+    // service requests set up or off by port_enable_srq in the meantime
+    if (ok && (j.srq != j.ro_srq) && (sessions[s]->be->enable_srq(sessions[s], j.srq) != gpib_ok))
+    {
+        tracef(TRACE_ERROR, "service requests of %s not set up again", sessions[s]->addr);
+        j.srq = j.ro_srq;
+    }
+    if (ok)
+    {
+        tracef(TRACE_INFO, "session %d is back after %lu ms", s,
+               (unsigned long)((now - j.down_at) / 1000));
+        j.down = false;
+        sessions_down--;
+        if (co_check(s) != 0)
+            return 1;
+        if (j.head == NULL)
+            return 0;
+        jobs_busy++;
+        return job_run(s, job_begin(s));
+    }
+    if (now - j.down_at < (u64)reconnect_s * 1000000)
+    {
+        j.retry_ms = j.retry_ms * 2 < RECONNECT_MAX_MS ? j.retry_ms * 2 : RECONNECT_MAX_MS;
+        j.retry_at = now + (u64)j.retry_ms * 1000;
+        return 0;
+    }
+
+    j.down = false;
+    sessions_down--;
+    job_drop(s, 0, 0, true, "Session lost");
+    if (s == 0)
+    {
+        dbg_print("Error : unable to reopen %s\n", sessions[s]->addr);
+        return 1;
+    }
+    close_session(s);
+    session_forget(s);
+    return 0;
+}
+
+// moves on the batches whose delay has ended, sends the writes whose
+// window has, ends the requests whose deadline has passed and opens lost
+// sessions again
+int job_wake()
+{
+    u64 now = now_us();
+    int i;
+
+    for (i = 0; (i < MAX_SESSIONS) && ((jobs_busy > 0) || (co_pending > 0) || (sessions_down > 0)); i++)
+    {
+        if (deadlines && (job_expire(i, now) != 0))
+            return 1;
+        if (jobs[i].down)
+        {
+            if (!jobs[i].reopening && (jobs[i].retry_at <= now) && (job_retry(i) != 0))
+                return 1;
+            continue;
+        }
+        if ((jobs[i].req == NULL) && (jobs[i].co_len > 0) && (jobs[i].co_due <= now))
+        {
+            if (co_check(i) != 0)
+                return 1;
+            jobs_busy++;
+            if (job_run(i, job_begin(i)) != 0)
+                return 1;
+            continue;
+        }
+        if ((jobs[i].req == NULL) || (jobs[i].step != job_delay) || (jobs[i].wake > now))
+            continue;
+        if (job_run(i, job_step(i, gpib_ok, 0)) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// sends the held writes right away, on shutdown; those of lost sessions
+// are dropped
+void job_flush()
+{
+    int i;
+
+    for (i = 0; i < MAX_SESSIONS; i++)
+    {
+        jobs[i].co_due = 0;
+        if (jobs[i].down && (jobs[i].co_len > 0))
+        {
+            jobs[i].co_len = 0;
+            co_pending--;
+        }
+    }
+}
+
+// Queues the end of a transfer for the main loop. Called from a driver
+// thread; there is one transfer per session, so the event is preallocated.
+void port_on_complete(gpib_dev *dev, const int status, const long cnt)
+{
+    gpib_port_comm *c = &jobs[dev->handle].done;
+
+    c->t = command_io_done;
+    c->event = true;
+    c->id = 0;
+    c->session = dev->handle;
+    c->len = 5;
+    c->b = jobs[dev->handle].done_b;
+    c->b[0] = status;
+    put_u32(c->b + 1, cnt);
+    inbox_push(c, false);
+}
+
+// payload: [flags:1 [level:1]], flag 1 clears the ring after the dump
+void port_get_trace(gpib_port_comm &c)
+{
+    static port_frame f = {NULL, 0};
+    long size = (long)TRACE_ENTRIES * (TRACE_MSG_LEN + 26);
+    byte *p = frame_payload(f, size);
+    long n = p != NULL ? trace_dump((char *)p, size) : 0;
+
+    send_frame_in_place(f, command_get_trace, n);
+    if ((c.len >= 1) && (c.b[0] & 1))
+        trace_clear();
+    if (c.len >= 2)
+        trace_level = c.b[1];
+}
+
+static byte *put_u64(byte *p, u64 v)
+{
+    put_u32(p, (unsigned long)(v >> 32));
+    put_u32(p + 4, (unsigned long)(v & 0xffffffff));
+    return p + 8;
+}
+
+// payload: [flags:1], flag 1 resets the counters after the snapshot
+//     <ra_hits:4><ra_misses:4><co_writes:4><co_sends:4>
+//     <out_bytes:8><out hist>      writes to stdout
+//     <n:2>, then n times
+//         <session:2><command:1><count:4><timeouts:4><bytes:8>
+//         <p50:4><p99:4><queue hist><bus hist><total hist>
+// Times are in us, p50/p99 of the total; a hist is what hist_put writes.
+void port_stats(gpib_port_comm &c)
+{
+    static port_frame f = {NULL, 0};
+    long size = 16 + 8 + hist_size(&out_hist) + 2;
+    byte *p, *start;
+    cmd_stats *st;
+    int i, t, n = 0;
+
+    for (i = 0; i < MAX_SESSIONS; i++)
+    {
+        for (t = 0; t < (int)arr_len(stats[i]); t++)
+        {
+            st = stats[i][t];
+            if ((st == NULL) || (st->count == 0))
+                continue;
+            size += 27 + hist_size(&st->queue) + hist_size(&st->bus) + hist_size(&st->total);
+            n++;
+        }
+    }
+    start = p = frame_payload(f, size);
+    if (p == NULL)
+    {
+        send_msg_error("Out of memory");
+        return;
+    }
+
+    put_u32(p, ra_hits);
+    put_u32(p + 4, ra_misses);
+    put_u32(p + 8, co_writes);
+    put_u32(p + 12, co_sends);
+    p = put_u64(p + 16, out_bytes);
+    p += hist_put(&out_hist, p);
+    p[0] = (n >> 8) & 0xff;
+    p[1] = n & 0xff;
+    p += 2;
+    for (i = 0; i < MAX_SESSIONS; i++)
+    {
+        for (t = 0; t < (int)arr_len(stats[i]); t++)
+        {
+            st = stats[i][t];
+            if ((st == NULL) || (st->count == 0))
+                continue;
+            p[0] = (i >> 8) & 0xff;
+            p[1] = i & 0xff;
+            p[2] = t;
+            put_u32(p + 3, st->count);
+            put_u32(p + 7, st->timeouts);
+            p = put_u64(p + 11, st->bytes);
+            put_u32(p, (unsigned long)hist_percentile(&st->total, 50));
+            put_u32(p + 4, (unsigned long)hist_percentile(&st->total, 99));
+            p += 8;
+            p += hist_put(&st->queue, p);
+            p += hist_put(&st->bus, p);
+            p += hist_put(&st->total, p);
+        }
+    }
+    send_frame_in_place(f, command_stats, p - start);
+
+    if ((c.len >= 1) && (c.b[0] & 1))
+    {
+        ra_hits = 0;
+        ra_misses = 0;
+        co_writes = 0;
+        co_sends = 0;
+        out_bytes = 0;
+        memset(&out_hist, 0, sizeof(out_hist));
+        for (i = 0; i < MAX_SESSIONS; i++)
+        {
+            for (t = 0; t < (int)arr_len(stats[i]); t++)
+            {
+                if (stats[i][t] != NULL)
+                    memset(stats[i][t], 0, sizeof(cmd_stats));
+            }
+        }
+    }
+}
+
+// payload: [op:1][resource], needs -cache; the file is read again each
+// time, as -ls of another process may have rewritten it
+//     op 0: the lines of the file
+//     op 1: drops the entry of resource, all of them without one
+void port_inventory(gpib_port_comm &c)
+{
+    static port_frame f = {NULL, 0};
+    byte *p;
+    long n;
+
+    if (inv_path[0] == '\0')
+    {
+        send_msg_error("No inventory cache");
+        return;
+    }
+    inv_load();
+    if ((c.len >= 1) && (c.b[0] == 1))
+    {
+        inv_drop(c.len > 1 ? (const char *)c.b + 1 : "");
+        if (!inv_save())
+            send_msg_error("Unable to write the inventory cache");
+        else
+            send_comm_response(command_inventory, c.b, 0);
+        return;
+    }
+    n = (long)inv_count() * INV_LINE_MAX + 1;
+    p = frame_payload(f, n);
+    n = p != NULL ? inv_dump((char *)p, n) : 0;
+    send_frame_in_place(f, command_inventory, n);
+}
+
+int port_enable_srq(gpib_dev *dev, bool on)
+{
+    int r;
+
+    if (dev->be->enable_srq == NULL)
+        return gpib_error;
+    // a lost session gets it when it is back
+    if (jobs[dev->handle].down)
+    {
+        jobs[dev->handle].srq = on;
+        return gpib_ok;
+    }
+    r = dev->be->enable_srq(dev, on);
+    if (r == gpib_ok)
+        jobs[dev->handle].srq = on;
+    return r;
+}
+
+// Serves c, which is freed or handed over to a job. Returns 0 to go on,
+// 1 on error, 2 on shutdown.
+int port_dispatch(gpib_port_comm *c)
+{
+    gpib_dev *dev;
+    byte h[2];
+    int n, r;
+
+    if (c->event)
+    {
+        // end of a transfer, from port_on_complete
+        if (c->t == command_io_done)
+            return job_run(c->session, job_step(c->session, c->b[0], get_u32(c->b + 1)));
+        if (c->t == command_reopen_done)
+            return job_reopened(c->session, c->b[0] != 0);
+
+        // service request data queued by port_on_receive, or the error
+        // answering a frame port_reader dropped
+        cur_id = c->id;
+        cur_session = c->session;
+        send_comm_response(c->t, c->b, c->len);
+        free(c);
+        return 0;
+    }
+
+    cur_id = c->id;
+    cur_session = c->session;
+    if (c->t == command_deadline)
+    {
+        // the request inside, with a deadline from when it was read
+        if ((c->len < 5) || (c->b[4] == command_deadline))
+        {
+            free(c);
+            send_msg_error("Bad deadline");
+            return 0;
+        }
+        n = (int)get_u32(c->b);
+        c->deadline = n > 0 ? c->at + (u64)n * 1000 : 0;
+        deadlines = deadlines || (n > 0);
+        c->t = c->b[4];
+        c->b += 5;
+        c->len -= 5;
+    }
+
+    switch (c->t)
+    {
+    case command_open_session:
+        trace(TRACE_DEBUG, "command_open_session");
+
+        n = open_session((const char *)c->b);
+        free(c);
+        if (n < 0)
+        {
+            send_msg_error("Unable to open session");
+            return 0;
+        }
+        cur_session = n;
+        h[0] = (n >> 8) & 0xff;
+        h[1] = n & 0xff;
+        send_comm_response(command_open_session, h, 2);
+        return 0;
+    case command_get_trace:
+        port_get_trace(*c);
+        free(c);
+        return 0;
+    case command_stats:
+        port_stats(*c);
+        free(c);
+        return 0;
+    case command_inventory:
+        port_inventory(*c);
+        free(c);
+        return 0;
+    case command_cancel:
+        trace(TRACE_DEBUG, "command_cancel");
+
+        if (find_session(c->session) == NULL)
+        {
+            free(c);
+            send_msg_error("No such session");
+            return 0;
+        }
+        r = job_cancel(c->session, c->len >= 4 ? get_u32(c->b) : 0, c->len < 4, &n);
+        cur_id = c->id;
+        cur_session = c->session;
+        free(c);
+        h[0] = (n >> 8) & 0xff;
+        h[1] = n & 0xff;
+        send_comm_response(command_cancel, h, 2);
+        return r;
+    case command_write_to_gpib:
+    case command_read_from_gpib:
+    case command_query:
+    case command_batch:
+    case command_read_stream:
+    case command_read_block:
+    case command_set_xform:
+    case command_set_timeout:
+    case command_setup:
+    case command_close_session:
+    case command_srq:
+        break;
+    default:
+        free(c);
+        return 2;
+    }
+
+    dev = find_session(c->session);
+    if (dev == NULL)
+    {
+        free(c);
+        send_msg_error("No such session");
+        return 0;
+    }
+
+    switch (c->t)
+    {
+    case command_srq:
+        trace(TRACE_DEBUG, "command_srq");
+
+        n = port_enable_srq(dev, (c->len < 1) || (c->b[0] != 0));
+        free(c);
+        if (n != gpib_ok)
+            send_msg_error("Unable to set up service requests");
+        else
+            send_comm_response(command_srq, h, 0);
+        return 0;
+    case command_write_to_gpib:
+        trace(TRACE_DEBUG, "command_write_to_gpib");
+        break;
+    case command_read_from_gpib:
+        trace(TRACE_DEBUG, "command_read_from_gpib");
+        break;
+    case command_query:
+        trace(TRACE_DEBUG, "command_query");
+        break;
+    case command_batch:
+        trace(TRACE_DEBUG, "command_batch");
+        break;
+    case command_read_stream:
+        trace(TRACE_DEBUG, "command_read_stream");
+        break;
+    case command_read_block:
+        trace(TRACE_DEBUG, "command_read_block");
+        break;
+    case command_set_xform:
+        trace(TRACE_DEBUG, "command_set_xform");
+        break;
+    case command_set_timeout:
+        trace(TRACE_DEBUG, "command_set_timeout");
+        break;
+    case command_setup:
+        trace(TRACE_DEBUG, "command_setup");
+        break;
+    default:
+        trace(TRACE_DEBUG, "command_close_session");
+        break;
+    }
+    return job_submit(c->session, c);
+}
+
+// dev is the device given on the command line, it may be NULL with -proto 3
+int as_port(const gpib_backend *be, gpib_dev *dev)
+{
+    gpib_port_comm *c;
+    bool stopping = false;
+    int r;
+
+    if ((packet_bytes != 2) && (packet_bytes != 4))
+    {
+        dbg_print("packet size must be 2 or 4\n");
+        return 1;
+    }
+    if ((proto < 1) || (proto > 3))
+    {
+        dbg_print("unsupported protocol version %d\n", proto);
+        return 1;
+    }
+
+    port_backend = be;
+    sessions[0] = dev;
+    if (dev != NULL)
+    {
+        dev->handle = 0;
+        dev->on_complete = port_on_complete;
+        tmo_load(0);
+    }
+
+    lock_init(&inbox_lock);
+    event_init(&inbox_ready);
+    event_init(&inbox_space);
+    if (!thread_start(port_reader, NULL))
+    {
+        dbg_print("Unable to start the port reader\n");
+        return 1;
+    }
+
+    tracef(TRACE_INFO, "as_port, packet %d, proto %d%s, coalesce %ld us, tmo_adapt %ld",
+           packet_bytes, proto, read_ahead ? ", read ahead" : "", coalesce_us, tmo_adapt);
+    while (!stopping || (jobs_busy > 0) || (co_pending > 0) || (reopens > 0))
+    {
+        trace(TRACE_DEBUG, "wait for command");
+        c = inbox_pop(job_timeout());
+        if (c == NULL)
+            r = job_wake();
+        else if (stopping && !c->event)
+        {
+            // shutting down, only the transfers in flight are finished
+            free(c);
+            r = 0;
+        }
+        else
+            r = port_dispatch(c);
+
+        if (r == 1)
+        {
+            out_flush();
+            return 1;
+        }
+        if (r == 2)
+        {
+            stopping = true;
+            job_flush();
+        }
+    }
+
+    close_sessions();
+    if (dev != NULL)
+    {
+        tmo_save(0);
+        gpib_shutdown(dev);
+    }
+    return 0;
+}
+
+int interactive(gpib_dev *dev)
+{
+    while (true)
+    {
+        char s[10240 + 1];
+        long cnt = 0;
+        int status;
+
+        s[0] = '\0';
+        if ((fgets(s, sizeof(s), stdin) == NULL) || (strlen(s) >= sizeof(s) - 1))
+        {
+            gpib_shutdown(dev);
+            break;
+        }
+        s[strcspn(s, "\r\n")] = '\0';
+
+        if (strlen(s) > 0)
+        {
+            if (dev->be->write(dev, (byte *)s, strlen(s), &cnt) != gpib_ok)
+            {
+               dev->be->cleanup(dev, "Unable to write to device");
+               return 1;
+            }
+        }
+        else    // strlen(s) = 0, read response up to END
+        {
+            do
+            {
+                status = dev->be->read(dev, (byte *)s, sizeof(s) - 1, &cnt);
+                if (status != gpib_ok)
+                    break;
+                fwrite(s, 1, cnt, stdout);
+            } while (!dev->end && (cnt > 0));
+
+            if ((status != gpib_ok) && (status != gpib_timeout))
+            {
+                dev->be->cleanup(dev, "Unable to read data from device");
+                return 1;
+            }
+            if (status == gpib_ok)
+                printf("\n");
+        }
+    }
+    return 0;
+}
+
+void stdout_on_receive(gpib_dev *dev, const int stb, const byte *s, const long len)
+{
+    (void)dev;
+    if (len < 0)
+    {
+        dbg_print("service request failed\n");
+        return;
+    }
+    printf("SRQ 0x%02x: ", stb);
+    fwrite(s, 1, len, stdout);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Queues the data for the main loop, which is the only writer of the port.
+void port_on_receive(gpib_dev *dev, const int stb, const byte *s, const long len)
+{
+    static const char err[] = "Service request failed";
+    long n = len < 0 ? (long)strlen(err) : len + 1;
+    gpib_port_comm *c = (gpib_port_comm *)malloc(sizeof(gpib_port_comm) + n + 1);
+    if (c == NULL)
+        return;
+
+    c->event = true;
+    c->id = 0;
+    c->session = dev->handle;
+    c->len = n;
+    c->b = (byte *)(c + 1);
+    if (len < 0)
+    {
+        c->t = command_error;
+        memcpy(c->b, err, n);
+    }
+    else
+    {
+        c->t = command_srq;
+        c->b[0] = stb;
+        memcpy(c->b + 1, s, len);
+    }
+    c->b[n] = 0;
+    inbox_push(c, false);
+}
@@ -0,0 +1,180 @@
+
+#ifndef _GPIB_PORT_H
+#define _GPIB_PORT_H
+
+#include "gpib_dev.h"
+
+extern bool shutup;
+extern bool port;
+extern bool srq;                // push service request data
+extern int  packet_bytes;       // length prefix, 2 or 4 as Erlang {packet, N}
+extern long max_frame;          // max frame size with 4-byte prefix
+extern long read_size;          // max bytes of one device read
+extern long out_buf_size;       // output batching buffer, 0 = write through
+extern long flush_us;           // max time a frame waits in the buffer
+extern int  proto;              // 1: plain, 2: request ids, 3: sessions
+extern bool read_ahead;         // read the response of a query right away
+extern long coalesce_us;        // window joining writes, 0 = off
+extern long tmo_adapt;          // read timeout = N x p99 of the answers, 0 = off
+extern long tmo_min;            // least adaptive timeout (ms)
+extern long tmo_max;            // most adaptive timeout (ms)
+extern long reconnect_s;        // keep opening a lost session for N s,
+                                // 0 = try once
+
+void dbg_print(const char *fmt, ...);
+
+#define MAX_COMM_PACK_SIZE   65536
+#define MAX_COMM_PACK_SIZE_4 (64L * 1024 * 1024)
+
+#define command_write_to_gpib       0
+#define command_read_from_gpib      1
+#define command_dbg_msg             2   // no longer sent, see command_get_trace
+#define command_shutdown            3
+#define command_read_more           4   // continuation of a large response
+#define command_query               5   // write, then read the response
+#define command_batch               6   // list of writes/queries/delays,
+                                        // see batch_end
+
+// operations of command_batch
+#define batch_op_write              0
+#define batch_op_query              1
+#define batch_op_delay              2   // data is the delay in ms, 4 bytes
+#define BATCH_OK                    0xffffffffUL
+
+#define command_open_session        7   // payload is the resource address
+#define command_close_session       8
+#define command_error               9   // payload is the error message
+#define command_get_trace           10  // dump of the trace ring
+#define command_srq                 11  // [on:1] enables service requests,
+                                        // pushed as [stb:1][data] with id 0
+#define command_read_stream         12  // [data] is written first, then chunks
+                                        // are read until END, each one sent
+                                        // right away as command_read_more
+#define command_read_block          13  // [data] is written first, then an
+                                        // IEEE 488.2 block is read, see
+                                        // block_step
+#define command_set_xform           14  // [kind:1] transform of the responses
+                                        // to reads, queries, streams and
+                                        // blocks; xform_wave adds
+                                        // [type:1][big:1][scale:8][offset:8]
+#define command_stats               15  // [flags:1] counters, see port_stats
+#define command_inventory           16  // [op:1][resource] inventory cache,
+                                        // see port_inventory
+#define command_set_timeout         17  // [ms:4][header] timeout of the reads
+                                        // answering header, see tmo_pick
+#define command_cancel              18  // [id:4] ends request id of the
+                                        // session, all of them without;
+                                        // answered with [count:2]
+#define command_deadline            19  // [ms:4][command:1][payload] runs
+                                        // command, ended if not answered
+                                        // within ms, see job_expire
+#define command_io_error            20  // [class:1][code:4][message] a failed
+                                        // transfer, class is a gpib_status,
+                                        // see job_error; with -proto 1 not
+                                        // sent for writes
+#define command_setup               21  // [data] written like command 0 and
+                                        // replayed whenever the session is
+                                        // opened again; empty clears them
+
+int read_exact(byte *buf, int len);
+int write_exact(byte *buf, int len);
+struct io_vec
+{
+    const byte *base;
+    long len;
+};
+
+int write_vec(io_vec *v, int n);
+int put_packet_len(byte *h, long len);
+long read_packet_len();
+long read_cmd(byte **buf, long *size);
+int out_flush();
+int write_frame(const byte *h, int hl, const byte *buf, long len);
+int write_cmd(byte *buf, long len);
+long max_frame_size();
+
+// With -proto 2 every request is <command:1><id:4><payload> and every
+// response frame echoes the id of the request it belongs to. -proto 3
+// adds the session, <command:1><id:4><session:2><payload>.
+
+#define MAX_SESSIONS 64
+
+struct gpib_port_comm
+{
+    int len;
+    char t;
+    unsigned long id;
+    int session;
+    bool event;                 // pushed by a driver thread, not a request
+    u64 at;                     // when it was read, for port_stats
+    u64 deadline;               // ended from then on, 0 = never
+    byte *b;
+    gpib_port_comm *next;
+};
+
+#define INBOX_MAX 256           // requests read ahead of the main loop
+
+int frame_overhead();
+int put_frame_header(byte *h, const int t, const long len);
+void inbox_push(gpib_port_comm *c, bool wait);
+gpib_port_comm *inbox_pop(long ms);
+gpib_port_comm *read_comm_cmd();
+bool send_frame(const int t, const byte *s, const long len);
+bool send_comm_response(const int t, const byte *s, const long len);
+void send_msg_error(const char *s);
+
+// Frame buffer with room for the header in front of the payload, so the
+// device can read straight into the outgoing frame.
+#define FRAME_HDR_ROOM 11       // 4-byte length + command + id + session
+#define ZERO_COPY_MIN  4096     // smaller frames still go through out_buf
+
+struct port_frame
+{
+    byte *buf;
+    long size;
+};
+
+byte *frame_payload(port_frame &f, const long len);
+bool send_frame_in_place(port_frame &f, const int t, const long len);
+
+void gpib_shutdown(gpib_dev *dev);
+int open_session(const char *addr);
+void close_session(int s);
+void close_sessions();
+gpib_dev *find_session(int s);
+
+// -cache: read timeouts learned for the device of a session, kept in its
+// inventory entry
+void tmo_load(int s);
+void tmo_save(int s);
+
+unsigned long get_u32(const byte *b);
+void put_u32(byte *b, unsigned long v);
+double get_f64(const byte *b);
+
+// Bus requests are queued per session and run as jobs driven by the
+// completion of asynchronous transfers, see gpib_backend.read_async.
+#define command_io_done             127     // internal event, never sent
+#define command_reopen_done         126     // internal event, see job_retry
+
+int io_start(gpib_dev *dev, bool wr, byte *buf, long len, long *cnt);
+int job_submit(int s, gpib_port_comm *c);
+int job_retry(int s);
+int job_reopened(int s, bool ok);
+long job_timeout();
+int job_wake();
+void job_flush();
+
+void port_get_trace(gpib_port_comm &c);
+void port_stats(gpib_port_comm &c);
+void port_inventory(gpib_port_comm &c);
+int port_enable_srq(gpib_dev *dev, bool on);
+int port_dispatch(gpib_port_comm *c);
+int as_port(const gpib_backend *be, gpib_dev *dev);
+int interactive(gpib_dev *dev);
+
+void stdout_on_receive(gpib_dev *dev, const int stb, const byte *s, const long len);
+void port_on_receive(gpib_dev *dev, const int stb, const byte *s, const long len);
+void port_on_complete(gpib_dev *dev, const int status, const long cnt);
+
+#endif
@@ -0,0 +1,81 @@
+
+#include <string.h>
+
+#include "hist.h"
+
+static int hist_bucket(u64 v)
+{
+    int msb = 0;
+
+    if (v > U64(0xffffffff))
+        v = U64(0xffffffff);
+    if (v < 32)
+        return (int)v;
+    while ((v >> (msb + 1)) != 0)
+        msb++;
+    return (msb - 4) * 16 + (int)(v >> (msb - 4));
+}
+
+void hist_add(hist *h, u64 v)
+{
+    h->n[hist_bucket(v)]++;
+    h->count++;
+}
+
+u64 hist_low(int b)
+{
+    if (b < 32)
+        return b;
+    return (u64)(16 + b % 16) << (b / 16 - 1);
+}
+
+u64 hist_percentile(const hist *h, int pct)
+{
+    unsigned long seen = 0, want;
+    int b;
+
+    if (h->count == 0)
+        return 0;
+    want = (unsigned long)(((u64)h->count * pct + 99) / 100);
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->n[b];
+        if ((seen >= want) && (seen > 0))
+            return hist_low(b);
+    }
+    return hist_low(HIST_BUCKETS - 1);
+}
+
+long hist_size(const hist *h)
+{
+    long k = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+        k += h->n[b] != 0;
+    return 2 + k * 6;
+}
+
+long hist_put(const hist *h, byte *buf)
+{
+    long k = 0;
+    byte *p = buf + 2;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        if (h->n[b] == 0)
+            continue;
+        p[0] = (b >> 8) & 0xff;
+        p[1] = b & 0xff;
+        p[2] = (h->n[b] >> 24) & 0xff;
+        p[3] = (h->n[b] >> 16) & 0xff;
+        p[4] = (h->n[b] >> 8) & 0xff;
+        p[5] = h->n[b] & 0xff;
+        p += 6;
+        k++;
+    }
+    buf[0] = (k >> 8) & 0xff;
+    buf[1] = k & 0xff;
+    return p - buf;
+}
@@ -0,0 +1,28 @@
+#ifndef _HIST_H
+#define _HIST_H
+
+#include "platform.h"
+
+// Log-linear histogram of microseconds, HDR style: values below 32 have a
+// bucket each, above that every power of two is split in 16 buckets, so a
+// bucket is within 1/16 of its values. The range ends at 2^32 - 1 us.
+//     bucket b < 32: b us
+//     bucket b >= 32: from (16 + b % 16) << (b / 16 - 1) us
+#define HIST_BUCKETS 464
+
+struct hist
+{
+    unsigned long n[HIST_BUCKETS];
+    unsigned long count;
+};
+
+void hist_add(hist *h, u64 v);
+u64 hist_low(int b);                            // lowest value of bucket b
+u64 hist_percentile(const hist *h, int pct);    // lowest value of its bucket
+
+// Writes <k:2> and <bucket:2><count:4> for each of the k buckets in use,
+// big-endian, returns the bytes used. buf needs hist_size(h).
+long hist_put(const hist *h, byte *buf);
+long hist_size(const hist *h);
+
+#endif
@@ -0,0 +1,238 @@
+
+#ifndef _PLATFORM_H
+#define _PLATFORM_H
+
+// Tiny portability layer so the port loop can be built with the simulated
+// backend on a box without NI-488.2 or VISA installed.
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+
+#ifdef _MSC_VER
+typedef unsigned __int64 u64;
+#define U64(x) x##ui64
+#if _MSC_VER < 1900
+#define vsnprintf _vsnprintf
+#define snprintf  _snprintf
+#endif
+#else
+typedef unsigned long long u64;
+#define U64(x) x##ULL
+#endif
+
+#else
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+
+typedef unsigned char byte;
+typedef unsigned long long u64;
+#define U64(x) x##ULL
+
+#endif
+
+#define arr_len(x) (sizeof(x) / sizeof(x[0]))
+
+// monotonic clock in microseconds
+inline u64 now_us()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER t;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (u64)(t.QuadPart / freq.QuadPart) * 1000000
+         + (u64)(t.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+inline void sleep_us(u64 us)
+{
+    if (us == 0)
+        return;
+#ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    struct timespec ts;
+    ts.tv_sec  = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+inline void set_binary_stdio()
+{
+#ifdef _WIN32
+    setmode(0, O_BINARY);
+    setmode(1, O_BINARY);
+#endif
+}
+
+// threads, locks and auto-reset events
+
+typedef void (* f_thread)(void *arg);
+
+struct thread_arg
+{
+    f_thread fn;
+    void *arg;
+};
+
+#ifdef _WIN32
+
+inline DWORD WINAPI thread_entry(LPVOID p)
+{
+    thread_arg a = *(thread_arg *)p;
+    free(p);
+    a.fn(a.arg);
+    return 0;
+}
+
+inline bool thread_start(f_thread fn, void *arg)
+{
+    DWORD id;
+    HANDLE h;
+    thread_arg *a = (thread_arg *)malloc(sizeof(thread_arg));
+    if (a == NULL)
+        return false;
+    a->fn = fn;
+    a->arg = arg;
+    h = CreateThread(NULL, 0, thread_entry, a, 0, &id);
+    if (h == NULL)
+    {
+        free(a);
+        return false;
+    }
+    CloseHandle(h);
+    return true;
+}
+
+struct lock_t
+{
+    CRITICAL_SECTION cs;
+};
+
+inline void lock_init(lock_t *l)  { InitializeCriticalSection(&l->cs); }
+inline void lock_enter(lock_t *l) { EnterCriticalSection(&l->cs); }
+inline void lock_leave(lock_t *l) { LeaveCriticalSection(&l->cs); }
+
+struct event_t
+{
+    HANDLE h;
+};
+
+inline void event_init(event_t *e) { e->h = CreateEvent(NULL, FALSE, FALSE, NULL); }
+inline void event_set(event_t *e)  { SetEvent(e->h); }
+
+// returns false on timeout, ms < 0 waits forever
+inline bool event_wait(event_t *e, long ms)
+{
+    return WaitForSingleObject(e->h, ms < 0 ? INFINITE : (DWORD)ms) == WAIT_OBJECT_0;
+}
+
+#else
+
+inline void *thread_entry(void *p)
+{
+    thread_arg a = *(thread_arg *)p;
+    free(p);
+    a.fn(a.arg);
+    return NULL;
+}
+
+inline bool thread_start(f_thread fn, void *arg)
+{
+    pthread_t t;
+    thread_arg *a = (thread_arg *)malloc(sizeof(thread_arg));
+    if (a == NULL)
+        return false;
+    a->fn = fn;
+    a->arg = arg;
+    if (pthread_create(&t, NULL, thread_entry, a) != 0)
+    {
+        free(a);
+        return false;
+    }
+    pthread_detach(t);
+    return true;
+}
+
+struct lock_t
+{
+    pthread_mutex_t m;
+};
+
+inline void lock_init(lock_t *l)  { pthread_mutex_init(&l->m, NULL); }
+inline void lock_enter(lock_t *l) { pthread_mutex_lock(&l->m); }
+inline void lock_leave(lock_t *l) { pthread_mutex_unlock(&l->m); }
+
+struct event_t
+{
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    bool set;
+};
+
+inline void event_init(event_t *e)
+{
+    pthread_mutex_init(&e->m, NULL);
+    pthread_cond_init(&e->c, NULL);
+    e->set = false;
+}
+
+inline void event_set(event_t *e)
+{
+    pthread_mutex_lock(&e->m);
+    e->set = true;
+    pthread_cond_signal(&e->c);
+    pthread_mutex_unlock(&e->m);
+}
+
+// returns false on timeout, ms < 0 waits forever
+inline bool event_wait(event_t *e, long ms)
+{
+    struct timespec ts;
+    bool r;
+
+    pthread_mutex_lock(&e->m);
+    if (ms >= 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+    while (!e->set)
+    {
+        if (ms < 0)
+            pthread_cond_wait(&e->c, &e->m);
+        else if (pthread_cond_timedwait(&e->c, &e->m, &ts) == ETIMEDOUT)
+            break;
+    }
+    r = e->set;
+    e->set = false;
+    pthread_mutex_unlock(&e->m);
+    return r;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,437 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "probe.h"
+
+long probe_ms   = 500;
+int  probe_jobs = 16;
+bool probe_json = false;
+bool probe_refresh = false;
+char inv_path[260] = "";
+
+static const char *status_names[] = {"ok", "timeout", "error", "skipped"};
+
+#define PROBE_TUNE     4            // an instrument of the cache is probed
+#define PROBE_TUNE_MIN 50           // with 4x the time it took last, at least
+                                    // 50 ms, before the full probe_ms
+
+struct probe_pool
+{
+    probe_item *items;
+    int n;
+    f_probe fn;
+    int *groups;                // distinct groups, in order of appearance
+    int n_groups;
+    int next;                   // next group to take
+    int running;                // workers not done yet
+    lock_t lock;                // made once, reused by every run
+    event_t done;
+};
+
+static probe_pool pool;
+static bool pool_inited = false;
+
+static void probe_worker(void *arg)
+{
+    probe_pool *p = (probe_pool *)arg;
+    bool last = false;
+    int g, i;
+    u64 t;
+
+    for (;;)
+    {
+        lock_enter(&p->lock);
+        g = p->next < p->n_groups ? p->groups[p->next++] : -1;
+        if (g < 0)
+            last = --p->running == 0;
+        lock_leave(&p->lock);
+        if (g < 0)
+            break;
+
+        for (i = 0; i < p->n; i++)
+        {
+            probe_item *it = &p->items[i];
+            if ((it->group != g) || (it->status == probe_skipped) || it->done)
+                continue;
+            t = now_us();
+            p->fn(it);
+            it->ms = (long)((now_us() - t + 500) / 1000);
+        }
+    }
+    if (last)
+        event_set(&p->done);
+}
+
+int probe_group(const char *addr, int i)
+{
+    if (strncmp(addr, "GPIB", 4) == 0)
+        return atoi(addr + 4);
+    return 1000 + i;
+}
+
+void probe_run(probe_item *items, int n, f_probe fn)
+{
+    probe_pool *p = &pool;
+    int i, k, w;
+
+    p->groups = (int *)malloc((n > 0 ? n : 1) * sizeof(int));
+    if (p->groups == NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if ((items[i].status != probe_skipped) && !items[i].done)
+                items[i].status = probe_error;
+        }
+        return;
+    }
+    p->items = items;
+    p->n = n;
+    p->fn = fn;
+    p->n_groups = 0;
+    p->next = 0;
+    for (i = 0; i < n; i++)
+    {
+        for (k = 0; (k < p->n_groups) && (p->groups[k] != items[i].group); k++)
+            ;
+        if (k == p->n_groups)
+            p->groups[p->n_groups++] = items[i].group;
+    }
+
+    w = probe_jobs < p->n_groups ? probe_jobs : p->n_groups;
+    if (w < 1)
+        w = 1;
+    if (!pool_inited)
+    {
+        lock_init(&p->lock);
+        event_init(&p->done);
+        pool_inited = true;
+    }
+    p->running = w;
+
+    // the calling thread is one of the workers
+    for (i = 1; i < w; i++)
+    {
+        if (thread_start(probe_worker, p))
+            continue;
+        lock_enter(&p->lock);
+        p->running--;
+        lock_leave(&p->lock);
+    }
+    probe_worker(p);
+    event_wait(&p->done, -1);
+    free(p->groups);
+    p->groups = NULL;
+}
+
+long probe_tmo(const probe_item *it)
+{
+    return it->tmo > 0 ? it->tmo : probe_ms;
+}
+
+void probe_set_idn(probe_item *it, const byte *s, long len)
+{
+    if (len > (long)sizeof(it->idn) - 1)
+        len = sizeof(it->idn) - 1;
+    while ((len > 0) && ((s[len - 1] == '\n') || (s[len - 1] == '\r')))
+        len--;
+    memcpy(it->idn, s, len);
+    it->idn[len] = '\0';
+}
+
+static void print_json_str(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+    {
+        if ((*s == '"') || (*s == '\\'))
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", (unsigned char)*s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+void probe_print(const probe_item *items, int n, u64 us)
+{
+    int i, found = 0;
+
+    for (i = 0; i < n; i++)
+        found += items[i].status == probe_ok;
+
+    if (!probe_json)
+    {
+        for (i = 0; i < n; i++)
+            printf("%-32s %-8s %6ld ms  %s\n", items[i].addr,
+                   status_names[items[i].status], items[i].ms, items[i].idn);
+        printf("\n%d resources, %d answered, %lu ms\n", n, found,
+               (unsigned long)(us / 1000));
+        return;
+    }
+
+    printf("{\"ms\": %lu, \"answered\": %d, \"instruments\": [", (unsigned long)(us / 1000), found);
+    for (i = 0; i < n; i++)
+    {
+        printf(i > 0 ? ",\n  {\"resource\": " : "\n  {\"resource\": ");
+        print_json_str(items[i].addr);
+        printf(", \"status\": \"%s\", \"ms\": %ld, \"idn\": ",
+               status_names[items[i].status], items[i].ms);
+        print_json_str(items[i].idn);
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+
+// the instruments that answered replace the entries of the cache
+static void inv_update(const probe_item *items, int n, bool all);
+
+int probe_scan(f_find find, f_probe fn)
+{
+    probe_item *items = NULL;
+    int n = 0, i, stale = 0;
+    bool search;
+    long ms;
+    u64 t = now_us();
+
+    if (inv_path[0] != '\0')
+        inv_load();
+    search = probe_refresh || (inv_count() == 0);
+
+    if (!search)
+    {
+        n = inv_count();
+        items = (probe_item *)calloc(n, sizeof(probe_item));
+        if (items == NULL)
+            return 1;
+        for (i = 0; i < n; i++)
+        {
+            strcpy(items[i].addr, inv_at(i)->addr);
+            items[i].group = probe_group(items[i].addr, i);
+            ms = inv_at(i)->ms * PROBE_TUNE;
+            ms = ms < PROBE_TUNE_MIN ? PROBE_TUNE_MIN : ms;
+            items[i].tmo = ms < probe_ms ? ms : 0;
+        }
+        probe_run(items, n, fn);
+
+        // only those that failed within the shorter timeout are probed again
+        for (i = 0; i < n; i++)
+        {
+            if ((items[i].status == probe_ok) || (items[i].tmo == 0))
+            {
+                items[i].done = true;
+                continue;
+            }
+            items[i].status = probe_ok;
+            items[i].tmo = 0;
+            stale++;
+        }
+        if (stale > 0)
+            probe_run(items, n, fn);
+    }
+    else
+    {
+        n = find(&items);
+        if (n < 0)
+            return 1;
+        probe_run(items, n, fn);
+    }
+
+    if (inv_path[0] != '\0')
+    {
+        inv_update(items, n, search);
+        if (!inv_save())
+            fprintf(stderr, "Unable to write %s\n", inv_path);
+    }
+    probe_print(items, n, now_us() - t);
+    free(items);
+    return 0;
+}
+
+static inv_entry *inv = NULL;
+static int inv_n = 0;
+static int inv_size = 0;
+
+int inv_count()
+{
+    return inv_n;
+}
+
+inv_entry *inv_at(int i)
+{
+    return &inv[i];
+}
+
+inv_entry *inv_find(const char *addr)
+{
+    int i;
+
+    for (i = 0; i < inv_n; i++)
+    {
+        if (strcmp(inv[i].addr, addr) == 0)
+            return &inv[i];
+    }
+    return NULL;
+}
+
+// copies s into d of size n, tabs and line ends become spaces
+static void inv_field(char *d, const char *s, long n)
+{
+    long i;
+
+    for (i = 0; (i < n - 1) && (s[i] != '\0'); i++)
+        d[i] = (s[i] == '\t') || (s[i] == '\n') || (s[i] == '\r') ? ' ' : s[i];
+    d[i] = '\0';
+}
+
+inv_entry *inv_put(const char *addr, const char *idn, long ms)
+{
+    inv_entry *e = inv_find(addr);
+
+    if (e == NULL)
+    {
+        if (inv_n == inv_size)
+        {
+            int size = inv_size > 0 ? inv_size * 2 : 32;
+            inv_entry *p = (inv_entry *)realloc(inv, size * sizeof(inv_entry));
+            if (p == NULL)
+                return NULL;
+            inv = p;
+            inv_size = size;
+        }
+        e = &inv[inv_n++];
+        memset(e, 0, sizeof(*e));
+        inv_field(e->addr, addr, sizeof(e->addr));
+    }
+    inv_field(e->idn, idn, sizeof(e->idn));
+    e->seen = (unsigned long)time(NULL);
+    e->ms = ms;
+    return e;
+}
+
+void inv_drop(const char *addr)
+{
+    int i;
+
+    for (i = 0; i < inv_n; )
+    {
+        if ((addr[0] == '\0') || (strcmp(inv[i].addr, addr) == 0))
+            inv[i] = inv[--inv_n];
+        else
+            i++;
+    }
+}
+
+static void inv_update(const probe_item *items, int n, bool all)
+{
+    int i, k;
+
+    for (i = 0; i < n; i++)
+    {
+        if (items[i].status == probe_ok)
+            inv_put(items[i].addr, items[i].idn, items[i].ms);
+    }
+    if (!all)
+        return;
+
+    // after a search of the bus, what did not answer is gone
+    for (i = 0; i < inv_n; )
+    {
+        for (k = 0; k < n; k++)
+        {
+            if ((items[k].status == probe_ok) && (strcmp(items[k].addr, inv[i].addr) == 0))
+                break;
+        }
+        if (k < n)
+            i++;
+        else
+            inv[i] = inv[--inv_n];
+    }
+}
+
+bool inv_load()
+{
+    char line[1024], *f[5];
+    inv_entry *e;
+    FILE *fp;
+    int i;
+
+    inv_n = 0;
+    fp = fopen(inv_path, "r");
+    if (fp == NULL)
+        return false;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        f[0] = line;
+        for (i = 1; i < 5; i++)
+        {
+            f[i] = strchr(f[i - 1], '\t');
+            if (f[i] == NULL)
+                break;
+            *f[i]++ = '\0';
+        }
+        if ((i < 4) || (f[0][0] == '\0'))
+            continue;
+        e = inv_put(f[0], f[1], atol(f[3]));
+        if (e == NULL)
+            break;
+        e->seen = strtoul(f[2], NULL, 10);
+        if (i == 5)
+            inv_field(e->settings, f[4], sizeof(e->settings));
+    }
+    fclose(fp);
+    return true;
+}
+
+long inv_dump(char *buf, long size)
+{
+    long n = 0, k;
+    int i;
+
+    for (i = 0; i < inv_n; i++)
+    {
+        k = snprintf(buf + n, size - n, "%s\t%s\t%lu\t%ld\t%s\n", inv[i].addr,
+                     inv[i].idn, inv[i].seen, inv[i].ms, inv[i].settings);
+        if ((k < 0) || (k >= size - n))
+            break;
+        n += k;
+    }
+    return n;
+}
+
+// written to a temporary file first, so that another process never reads
+// half of it
+bool inv_save()
+{
+    char tmp[280];
+    FILE *fp;
+    char *buf;
+    long n = (long)inv_n * INV_LINE_MAX + 1;
+    bool ok;
+
+    buf = (char *)malloc(n);
+    if (buf == NULL)
+        return false;
+    n = inv_dump(buf, n);
+
+    sprintf(tmp, "%s.tmp", inv_path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL)
+    {
+        free(buf);
+        return false;
+    }
+    ok = (long)fwrite(buf, 1, n, fp) == n;
+    ok = (fclose(fp) == 0) && ok;
+    free(buf);
+    if (!ok)
+        return false;
+#ifdef _WIN32
+    return MoveFileExA(tmp, inv_path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp, inv_path) == 0;
+#endif
+}
@@ -0,0 +1,84 @@
+#ifndef _PROBE_H
+#define _PROBE_H
+
+#include "platform.h"
+
+// Instrument discovery for -ls. Probes run on worker threads, a group at
+// a time per worker: the instruments of one GPIB board share its bus and
+// are probed in turn, anything else (LAN, USB) is a group of its own.
+
+enum
+{
+    probe_ok = 0,
+    probe_timeout,              // no answer within probe_ms
+    probe_error,                // open or transfer failed
+    probe_skipped               // not a kind of resource *IDN? is sent to
+};
+
+struct probe_item
+{
+    char addr[256];             // resource, as given to -ip/-pad or open
+    int group;
+    int status;
+    char idn[256];              // *IDN? response without the line end
+    long ms;                    // time taken
+    long tmo;                   // timeout of the probe, 0 = probe_ms
+    bool done;                  // result known, not probed again
+};
+
+extern long probe_ms;           // timeout of one probe
+extern int  probe_jobs;         // max worker threads
+extern bool probe_json;         // print JSON instead of text
+extern bool probe_refresh;      // search the bus even if the cache holds
+
+typedef void (* f_probe)(probe_item *it);
+
+// searches the bus, *items is malloc'ed; returns the count or -1
+typedef int (* f_find)(probe_item **items);
+
+// group of a resource: its board for GPIB<n>::..., its own otherwise
+int probe_group(const char *addr, int i);
+
+// calls fn for each item, items of a group in order on one thread
+void probe_run(probe_item *items, int n, f_probe fn);
+
+// timeout of a probe of it in ms
+long probe_tmo(const probe_item *it);
+
+// copies a response into it->idn, without the line end
+void probe_set_idn(probe_item *it, const byte *s, long len);
+
+// prints the items, us is the time the whole scan took
+void probe_print(const probe_item *items, int n, u64 us);
+
+// -ls: probes the instruments of the cache, those that fail again with
+// the full timeout; searches the bus only without a cache or with -refresh
+int probe_scan(f_find find, f_probe fn);
+
+// Inventory cache, -cache <file>: a line per instrument that answered,
+//     <resource>\t<idn>\t<last seen, s since 1970>\t<probe ms>\t<settings>
+// settings are the read timeouts learned by the port, see tmo_save.
+
+extern char inv_path[260];      // empty = no cache
+
+#define INV_LINE_MAX 830        // longest line of the file
+
+struct inv_entry
+{
+    char addr[256];
+    char idn[256];
+    unsigned long seen;
+    long ms;
+    char settings[256];
+};
+
+bool inv_load();
+bool inv_save();
+int inv_count();
+inv_entry *inv_at(int i);
+inv_entry *inv_find(const char *addr);
+inv_entry *inv_put(const char *addr, const char *idn, long ms);
+void inv_drop(const char *addr);        // all entries for ""
+long inv_dump(char *buf, long size);    // the lines of the file
+
+#endif
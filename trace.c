@@ -0,0 +1,91 @@
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "trace.h"
+
+int trace_level = TRACE_INFO;
+
+struct trace_entry
+{
+    u64 t;
+    int level;
+    char msg[TRACE_MSG_LEN];
+};
+
+static trace_entry ring[TRACE_ENTRIES];
+static unsigned long ring_next = 0;     // total entries ever put
+static lock_t ring_lock;
+static bool ring_inited = false;
+
+static void ring_init()
+{
+    // the first trace comes from the main thread before any other starts
+    if (!ring_inited)
+    {
+        lock_init(&ring_lock);
+        ring_inited = true;
+    }
+}
+
+void trace_put(int level, const char *s)
+{
+    trace_entry *e;
+
+    ring_init();
+    lock_enter(&ring_lock);
+    e = &ring[ring_next % TRACE_ENTRIES];
+    e->t = now_us();
+    e->level = level;
+    strncpy(e->msg, s, sizeof(e->msg) - 1);
+    e->msg[sizeof(e->msg) - 1] = '\0';
+    ring_next++;
+    lock_leave(&ring_lock);
+}
+
+void tracef(int level, const char *fmt, ...)
+{
+    char s[TRACE_MSG_LEN];
+    va_list args;
+
+    if ((level > TRACE_MAX_LEVEL) || (level > trace_level))
+        return;
+    va_start(args, fmt);
+    vsnprintf(s, sizeof(s), fmt, args);
+    va_end(args);
+    s[sizeof(s) - 1] = '\0';
+    trace_put(level, s);
+}
+
+long trace_dump(char *buf, long size)
+{
+    unsigned long i, first;
+    long used = 0;
+    int n;
+
+    ring_init();
+    lock_enter(&ring_lock);
+    first = ring_next > TRACE_ENTRIES ? ring_next - TRACE_ENTRIES : 0;
+    for (i = first; i < ring_next; i++)
+    {
+        trace_entry *e = &ring[i % TRACE_ENTRIES];
+        // longest line: 20 digits, level, message and separators
+        if (size - used < TRACE_MSG_LEN + 26)
+            break;
+        n = sprintf(buf + used, "%lu.%03lu %d %s\n",
+                    (unsigned long)(e->t / 1000), (unsigned long)(e->t % 1000),
+                    e->level, e->msg);
+        used += n;
+    }
+    lock_leave(&ring_lock);
+    return used;
+}
+
+void trace_clear()
+{
+    ring_init();
+    lock_enter(&ring_lock);
+    ring_next = 0;
+    lock_leave(&ring_lock);
+}
@@ -0,0 +1,39 @@
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "platform.h"
+
+// Leveled tracing into an in-memory ring, fetched over the port with
+// command_get_trace instead of being pushed as debug frames.
+
+#define TRACE_OFF       0
+#define TRACE_ERROR     1
+#define TRACE_INFO      2
+#define TRACE_DEBUG     3
+
+// levels above this are compiled out
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_DEBUG
+#endif
+
+#define TRACE_ENTRIES   1024
+#define TRACE_MSG_LEN   60
+
+extern int trace_level;         // run-time filter
+
+#define trace(level, s)                                                     \
+    do {                                                                    \
+        if (((level) <= TRACE_MAX_LEVEL) && ((level) <= trace_level))       \
+            trace_put(level, s);                                            \
+    } while (false)
+
+void trace_put(int level, const char *s);
+void tracef(int level, const char *fmt, ...);
+
+// dumps the ring as text lines "<time ms> <level> <message>", oldest
+// first, returns the number of bytes used
+long trace_dump(char *buf, long size);
+void trace_clear();
+
+#endif
@@ -0,0 +1,558 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xform.h"
+
+// SSE2 finds the separators 16 bytes at a time and eight digits are
+// turned into a number at once (SWAR). Numbers with up to 19 digits and
+// a small exponent take Clinger's fast path, which is exact; the rest go
+// to strtod.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define XFORM_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are built with a target attribute, the CPU is asked at
+// run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define XFORM_AVX2
+#define AVX2_FN __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (_MSC_VER >= 1700) && (defined(_M_X64) || defined(_M_IX86))
+#define XFORM_AVX2
+#define AVX2_FN
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+int xform_size(int kind)
+{
+    switch (kind)
+    {
+    case xform_f64:
+        return 8;
+    case xform_f32:
+    case xform_wave:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// ',', ';', ' ' and control characters up to '\r'
+inline bool is_sep(byte c)
+{
+    return (c == ',') || (c == ';') || (c == ' ') || (c <= '\r');
+}
+
+inline int lowest_bit(unsigned v)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(v);
+#else
+    int n = 0;
+    while (!(v & 1))
+    {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// index of the first separator in s[0..len), len if there is none
+long find_sep(const byte *s, long len)
+{
+    long i = 0;
+
+#ifdef XFORM_SSE2
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i semi  = _mm_set1_epi8(';');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i cr    = _mm_set1_epi8('\r');
+    __m128i x, m;
+    int bits;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        x = _mm_loadu_si128((const __m128i *)(s + i));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, comma), _mm_cmpeq_epi8(x, semi)),
+                         _mm_or_si128(_mm_cmpeq_epi8(x, space),
+                                      _mm_cmpeq_epi8(_mm_min_epu8(x, cr), x)));
+        bits = _mm_movemask_epi8(m);
+        if (bits != 0)
+            return i + lowest_bit(bits);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (is_sep(s[i]))
+            return i;
+    }
+    return len;
+}
+
+long find_sep_scalar(const byte *s, long len)
+{
+    long i;
+    for (i = 0; i < len; i++)
+    {
+        if (is_sep(s[i]))
+            return i;
+    }
+    return len;
+}
+
+inline u64 load_le64(const byte *p)
+{
+    return (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) | ((u64)p[3] << 24)
+         | ((u64)p[4] << 32) | ((u64)p[5] << 40) | ((u64)p[6] << 48) | ((u64)p[7] << 56);
+}
+
+inline bool is_8digits(u64 v)
+{
+    return (((v & U64(0xf0f0f0f0f0f0f0f0))
+             | (((v + U64(0x0606060606060606)) & U64(0xf0f0f0f0f0f0f0f0)) >> 4))
+            == U64(0x3333333333333333));
+}
+
+inline unsigned long parse_8digits(u64 v)
+{
+    v -= U64(0x3030303030303030);
+    v = (v * 10) + (v >> 8);
+    v = (((v & U64(0x000000ff000000ff)) * U64(0x000f424000000064))
+         + (((v >> 16) & U64(0x000000ff000000ff)) * U64(0x0000271000000001))) >> 32;
+    return (unsigned long)v;
+}
+
+static const double pow10_tab[] =
+{
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// reads digits into *m, false if there are more than 19 significant ones
+inline bool read_digits(const byte *&p, const byte *e, u64 *m, int *digits)
+{
+    while ((e - p >= 8) && is_8digits(load_le64(p)))
+    {
+        if (*digits + 8 > 19)
+            return false;
+        *m = *m * 100000000 + parse_8digits(load_le64(p));
+        *digits += 8;
+        p += 8;
+    }
+    while ((p < e) && (*p >= '0') && (*p <= '9'))
+    {
+        if (*digits >= 19)
+            return false;
+        *m = *m * 10 + (*p - '0');
+        *digits += 1;
+        p++;
+    }
+    return true;
+}
+
+// Clinger's fast path, false if strtod has to do it
+bool parse_fast(const byte *p, const byte *e, double *v)
+{
+    bool neg = false, eneg = false, any = false;
+    u64 m = 0;
+    int digits = 0, scale = 0, ex = 0, n;
+    const byte *q;
+    double d;
+
+    if ((p < e) && ((*p == '+') || (*p == '-')))
+    {
+        neg = *p == '-';
+        p++;
+    }
+    while ((p < e) && (*p == '0'))
+    {
+        p++;
+        any = true;
+    }
+    q = p;
+    if (!read_digits(p, e, &m, &digits))
+        return false;
+    any = any || (p > q);
+
+    if ((p < e) && (*p == '.'))
+    {
+        p++;
+        if (digits == 0)
+        {
+            while ((p < e) && (*p == '0'))
+            {
+                p++;
+                scale++;
+                any = true;
+            }
+        }
+        q = p;
+        if (!read_digits(p, e, &m, &digits))
+            return false;
+        scale += p - q;
+        any = any || (p > q);
+    }
+    if (!any)
+        return false;
+
+    if ((p < e) && ((*p == 'e') || (*p == 'E')))
+    {
+        p++;
+        if ((p < e) && ((*p == '+') || (*p == '-')))
+        {
+            eneg = *p == '-';
+            p++;
+        }
+        for (n = 0; (p < e) && (*p >= '0') && (*p <= '9'); n++, p++)
+        {
+            if (n >= 4)
+                return false;
+            ex = ex * 10 + (*p - '0');
+        }
+        if (n == 0)
+            return false;
+        if (eneg)
+            ex = -ex;
+    }
+    if (p != e)
+        return false;
+
+    ex -= scale;
+    if (m == 0)
+    {
+        *v = neg ? -0.0 : 0.0;
+        return true;
+    }
+    if ((m > (U64(1) << 53)) || (ex < -22) || (ex > 22))
+        return false;
+
+    // exact, m fits into the 53 bits of a double
+    d = (double)(unsigned long)(m >> 32) * 4294967296.0 + (double)(unsigned long)(m & 0xffffffff);
+    d = ex >= 0 ? d * pow10_tab[ex] : d / pow10_tab[-ex];
+    *v = neg ? -d : d;
+    return true;
+}
+
+bool parse_slow(const byte *p, long n, double *v)
+{
+    char tmp[XFORM_KEEP_MAX + 1];
+    char *end;
+
+    if (n > XFORM_KEEP_MAX)
+        return false;
+    memcpy(tmp, p, n);
+    tmp[n] = '\0';
+    *v = strtod(tmp, &end);
+    return end == tmp + n;
+}
+
+inline void put_value(byte *out, int kind, double v)
+{
+    float f;
+    byte *b;
+    int size = kind == xform_f32 ? 4 : 8;
+
+    if (kind == xform_f32)
+    {
+        f = (float)v;
+        b = (byte *)&f;
+    }
+    else
+        b = (byte *)&v;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    for (int i = 0; i < size; i++)
+        out[i] = b[size - 1 - i];
+#else
+    memcpy(out, b, size);
+#endif
+}
+
+long decode(const byte *s, long len, int kind, bool last, byte *out, long *used, bool fast)
+{
+    int size = xform_size(kind);
+    long pos = 0, end = len, count = 0, n;
+    double v;
+
+    if (!last)
+    {
+        while ((end > 0) && !is_sep(s[end - 1]))
+            end--;
+    }
+
+    while (pos < end)
+    {
+        n = fast ? find_sep(s + pos, end - pos) : find_sep_scalar(s + pos, end - pos);
+        if (n > 0)
+        {
+            if (!(fast && parse_fast(s + pos, s + pos + n, &v)) && !parse_slow(s + pos, n, &v))
+            {
+                *used = pos;
+                return -1;
+            }
+            put_value(out + count * size, kind, v);
+            count++;
+        }
+        pos += n + 1;
+    }
+    *used = end;
+    return count;
+}
+
+long decode_ascii(const byte *s, long len, int kind, bool last, byte *out, long *used)
+{
+    return decode(s, len, kind, last, out, used, true);
+}
+
+long decode_ascii_scalar(const byte *s, long len, int kind, bool last, byte *out, long *used)
+{
+    return decode(s, len, kind, last, out, used, false);
+}
+
+// Waveforms: the samples are swapped, widened to 32 bits, converted and
+// scaled in registers; a tail shorter than a vector goes the scalar way.
+
+int wave_bytes(int type)
+{
+    switch (type)
+    {
+    case wave_i8:
+    case wave_u8:
+        return 1;
+    case wave_i16:
+    case wave_u16:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+inline void put_f32(byte *out, float v)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    put_value(out, xform_f32, v);
+#else
+    memcpy(out, &v, 4);
+#endif
+}
+
+void convert_wave_scalar(const byte *s, long n, const wave_fmt *f, byte *out)
+{
+    long i;
+    int x;
+
+    for (i = 0; i < n; i++)
+    {
+        switch (f->type)
+        {
+        case wave_i8:
+            x = (signed char)s[i];
+            break;
+        case wave_u8:
+            x = s[i];
+            break;
+        default:
+            x = f->big ? (s[2 * i] << 8) | s[2 * i + 1] : (s[2 * i + 1] << 8) | s[2 * i];
+            if ((f->type == wave_i16) && (x >= 0x8000))
+                x -= 0x10000;
+            break;
+        }
+        put_f32(out + 4 * i, x * f->scale + f->offset);
+    }
+}
+
+#ifdef XFORM_SSE2
+
+// converts the four 32-bit samples of x to floats at out
+inline void sse2_put(byte *out, __m128i x, __m128 scale, __m128 offset)
+{
+    _mm_storeu_ps((float *)out, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(x), scale), offset));
+}
+
+// widen the low/high half of x to twice the width
+inline __m128i widen8_lo(__m128i x, bool sign)
+{
+    return sign ? _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8) : _mm_unpacklo_epi8(x, _mm_setzero_si128());
+}
+
+inline __m128i widen8_hi(__m128i x, bool sign)
+{
+    return sign ? _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8) : _mm_unpackhi_epi8(x, _mm_setzero_si128());
+}
+
+inline __m128i widen16_lo(__m128i x, bool sign)
+{
+    return sign ? _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16) : _mm_unpacklo_epi16(x, _mm_setzero_si128());
+}
+
+inline __m128i widen16_hi(__m128i x, bool sign)
+{
+    return sign ? _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16) : _mm_unpackhi_epi16(x, _mm_setzero_si128());
+}
+
+// returns the samples done, the caller finishes the rest
+long convert_wave_sse2(const byte *s, long n, const wave_fmt *f, byte *out)
+{
+    const __m128 scale = _mm_set1_ps(f->scale);
+    const __m128 offset = _mm_set1_ps(f->offset);
+    bool sign = (f->type == wave_i8) || (f->type == wave_i16);
+    __m128i x, w;
+    long i = 0;
+
+    if (wave_bytes(f->type) == 1)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            x = _mm_loadu_si128((const __m128i *)(s + i));
+            w = widen8_lo(x, sign);
+            sse2_put(out + 4 * i,      widen16_lo(w, sign), scale, offset);
+            sse2_put(out + 4 * i + 16, widen16_hi(w, sign), scale, offset);
+            w = widen8_hi(x, sign);
+            sse2_put(out + 4 * i + 32, widen16_lo(w, sign), scale, offset);
+            sse2_put(out + 4 * i + 48, widen16_hi(w, sign), scale, offset);
+        }
+        return i;
+    }
+
+    for (; i + 8 <= n; i += 8)
+    {
+        x = _mm_loadu_si128((const __m128i *)(s + 2 * i));
+        if (f->big)
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        sse2_put(out + 4 * i,      widen16_lo(x, sign), scale, offset);
+        sse2_put(out + 4 * i + 16, widen16_hi(x, sign), scale, offset);
+    }
+    return i;
+}
+
+#endif
+
+#ifdef XFORM_AVX2
+
+AVX2_FN long convert_wave_avx2(const byte *s, long n, const wave_fmt *f, byte *out)
+{
+    const __m256 scale = _mm256_set1_ps(f->scale);
+    const __m256 offset = _mm256_set1_ps(f->offset);
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    __m256i x, w;
+    long i = 0;
+
+    // eight samples per register, widened straight from memory
+    switch (f->type)
+    {
+    case wave_i8:
+    case wave_u8:
+        for (; i + 8 <= n; i += 8)
+        {
+            w = f->type == wave_i8 ? _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(s + i)))
+                                   : _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(s + i)));
+            _mm256_storeu_ps((float *)(out + 4 * i),
+                             _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(w), scale), offset));
+        }
+        break;
+    default:
+        for (; i + 16 <= n; i += 16)
+        {
+            x = _mm256_loadu_si256((const __m256i *)(s + 2 * i));
+            if (f->big)
+                x = _mm256_shuffle_epi8(x, swap);
+            w = f->type == wave_i16 ? _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x))
+                                    : _mm256_cvtepu16_epi32(_mm256_castsi256_si128(x));
+            _mm256_storeu_ps((float *)(out + 4 * i),
+                             _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(w), scale), offset));
+            w = f->type == wave_i16 ? _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1))
+                                    : _mm256_cvtepu16_epi32(_mm256_extracti128_si256(x, 1));
+            _mm256_storeu_ps((float *)(out + 4 * i + 32),
+                             _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(w), scale), offset));
+        }
+        break;
+    }
+    return i;
+}
+
+bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+    int r[4];
+
+    __cpuid(r, 0);
+    if (r[0] < 7)
+        return false;
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || ((_xgetbv(0) & 6) != 6))     // OS saves YMM
+        return false;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+enum
+{
+    kernel_unknown,
+    kernel_scalar,
+    kernel_sse2,
+    kernel_avx2
+};
+
+static int kernel = kernel_unknown;
+
+int pick_kernel()
+{
+    if (kernel != kernel_unknown)
+        return kernel;
+    kernel = kernel_scalar;
+#ifdef XFORM_SSE2
+    kernel = kernel_sse2;
+#endif
+#ifdef XFORM_AVX2
+    if (cpu_has_avx2())
+        kernel = kernel_avx2;
+#endif
+    return kernel;
+}
+
+const char *wave_kernel()
+{
+    switch (pick_kernel())
+    {
+    case kernel_avx2:
+        return "avx2";
+    case kernel_sse2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+void convert_wave(const byte *s, long n, const wave_fmt *f, byte *out)
+{
+    long i = 0;
+
+    switch (pick_kernel())
+    {
+#ifdef XFORM_AVX2
+    case kernel_avx2:
+        i = convert_wave_avx2(s, n, f, out);
+        break;
+#endif
+#ifdef XFORM_SSE2
+    case kernel_sse2:
+        i = convert_wave_sse2(s, n, f, out);
+        break;
+#endif
+    default:
+        break;
+    }
+    convert_wave_scalar(s + i * wave_bytes(f->type), n - i, f, out + 4 * i);
+}
@@ -0,0 +1,63 @@
+
+#ifndef _XFORM_H
+#define _XFORM_H
+
+#include "platform.h"
+
+// Transforms applied to responses on their way to the port, set per
+// session with command_set_xform.
+
+enum
+{
+    xform_none = 0,
+    xform_f64,                  // ASCII list of numbers to float64 LE
+    xform_f32,                  // ... to float32 LE
+    xform_wave                  // binary samples to float32 LE, see wave_fmt
+};
+
+// sample types of xform_wave
+enum
+{
+    wave_i8 = 0,
+    wave_u8,
+    wave_i16,
+    wave_u16
+};
+
+// y = x * scale + offset; for a Tek preamble scale = YMULT and
+// offset = YZERO - YOFF * YMULT
+struct wave_fmt
+{
+    int type;
+    bool big;                   // 16-bit samples are big-endian
+    float scale;
+    float offset;
+};
+
+#define XFORM_KEEP_MAX 128      // longest number carried over to the next chunk
+
+// bytes of one output value, 0 for xform_none
+int xform_size(int kind);
+
+// Decodes numbers separated by ',', ';' or white space into packed
+// values of kind. With last false the input is only consumed up to the
+// last separator, the rest is a number cut by the chunk boundary. *used
+// is the input consumed. Returns the number of values, -1 if one is
+// malformed. out needs xform_size(kind) * (len / 2 + 1) bytes.
+long decode_ascii(const byte *s, long len, int kind, bool last, byte *out, long *used);
+
+// the same with strtod alone, baseline of bench/xform_bench.c
+long decode_ascii_scalar(const byte *s, long len, int kind, bool last, byte *out, long *used);
+
+// bytes of one sample, 0 for an unknown type
+int wave_bytes(int type);
+
+// Converts n samples to float32 LE with the AVX2, SSE2 or scalar kernel,
+// whichever the CPU runs best.
+void convert_wave(const byte *s, long n, const wave_fmt *f, byte *out);
+
+// the scalar kernel alone, and the name of the one convert_wave uses
+void convert_wave_scalar(const byte *s, long n, const wave_fmt *f, byte *out);
+const char *wave_kernel();
+
+#endif